@@ -0,0 +1,733 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "data_parallel.h"
+#include "generation.h"
+#include "gradient.h"
+#include "jit.h"
+#include "local_tape.h"
+#include "loop.h"
+#include "mat_operations.h"
+
+using namespace std;
+
+// self-contained benchmark harness
+//
+// usage: bench [--json] [--filter=substring] [--min-time=seconds]
+//
+// every benchmark body is repeated until it has run for at least
+// --min-time seconds (default 0.5). with --json the results are written as
+// a single JSON document so runs can be diffed across releases
+
+using Clock = chrono::steady_clock;
+
+struct Result {
+    string name;
+    long long items;
+    int iterations;
+    double seconds;
+};
+
+static vector<Result> results;
+static string filter;
+static double minSeconds = 0.5;
+
+template <typename F>
+void bench(const string &name, long long items, F body) {
+    if (!filter.empty() && name.find(filter) == string::npos) {
+        return;
+    }
+
+    int iterations = 0;
+    double seconds = 0;
+    do {
+        auto start = Clock::now();
+        body();
+        seconds += chrono::duration<double>(Clock::now() - start).count();
+        iterations++;
+    } while (seconds < minSeconds);
+
+    results.push_back({name, items, iterations, seconds});
+}
+
+void printTable() {
+    cout << left << setw(36) << "benchmark" << right << setw(12)
+         << "iterations" << setw(16) << "ns/iteration" << setw(16)
+         << "items/s" << endl;
+
+    for (auto &r : results) {
+        double ns = r.seconds * 1e9 / r.iterations;
+        double rate = r.items * r.iterations / r.seconds;
+
+        cout << left << setw(36) << r.name << right << setw(12)
+             << r.iterations << setw(16) << fixed << setprecision(0) << ns
+             << setw(16) << scientific << setprecision(3) << rate << endl;
+    }
+}
+
+void printJson() {
+    cout << "{\"benchmarks\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+        auto &r = results[i];
+        double ns = r.seconds * 1e9 / r.iterations;
+        double rate = r.items * r.iterations / r.seconds;
+
+        cout << (i ? "," : "") << "\n  {\"name\": \"" << r.name
+             << "\", \"items\": " << r.items
+             << ", \"iterations\": " << r.iterations
+             << ", \"ns_per_iteration\": " << ns
+             << ", \"items_per_second\": " << rate << "}";
+    }
+
+    cout << "\n]}" << endl;
+}
+
+struct Graph {
+    TapePtr<double> tape;
+    Variable<double> input;
+    Variable<double> output;
+};
+
+// same shape as selfAssignmentTest: a Constant, a Multiply and an output
+// node per step
+Graph chain(int steps) {
+    TapePtr<double> t(new Tape<double>());
+
+    Variable<double> x(1, t);
+    Variable<double> v = x;
+    for (int i = 0; i < steps; i++) {
+        v = v * 1.000001;
+    }
+
+    return {t, x, v};
+}
+
+// x fans out into `width` independent products that are summed back up
+Graph diamond(int width) {
+    TapePtr<double> t(new Tape<double>());
+
+    Variable<double> x(1, t);
+    Variable<double> sum(0, t);
+    for (int i = 0; i < width; i++) {
+        Variable<double> c(1 + i * 1e-3, t);
+        auto branch = x * c;
+        sum = sum + branch;
+    }
+
+    return {t, x, sum};
+}
+
+// compute and gradient redo the whole graph every iteration. without
+// invalidating or dirtying an input they would hit the dirty flags and the
+// gradient cache and time nothing
+void graphBenchmarks() {
+    for (int n : {1000, 100000}) {
+        string size = to_string(n);
+
+        bench("construct/chain/" + size, n, [&] { chain(n); });
+
+        Graph c = chain(n);
+        bench("compute/chain/" + size, n, [&] {
+            c.tape->invalidate();
+            c.tape->compute(&c.output);
+        });
+        bench("gradient/chain/" + size, n, [&] {
+            c.input.setValue(c.input.getValue());
+            c.tape->gradient(c.output, c.input);
+        });
+    }
+
+    for (int width : {1000, 100000}) {
+        string size = to_string(width);
+
+        bench("construct/diamond/" + size, width, [&] { diamond(width); });
+
+        Graph d = diamond(width);
+        bench("compute/diamond/" + size, width, [&] {
+            d.tape->invalidate();
+            d.tape->compute(&d.output);
+        });
+        bench("gradient/diamond/" + size, width, [&] {
+            d.input.setValue(d.input.getValue());
+            d.tape->gradient(d.output, d.input);
+        });
+
+        // every branch is 5 nodes after x and the initial sum. changing x
+        // dirties the whole graph, changing the last branch only its cone
+        Variable<double> lastBranch(d.tape, 2 + 5 * (width - 1));
+        bench("recompute/diamond/" + size + "/input", width, [&] {
+            d.input.setValue(d.input.getValue());
+            d.tape->compute(&d.output);
+        });
+        bench("recompute/diamond/" + size + "/last_branch", width, [&] {
+            lastBranch.setValue(lastBranch.getValue());
+            d.tape->compute(&d.output);
+        });
+    }
+
+    // selfAssignmentTest scaled up, end to end
+    const int steps = 1000000;
+    bench("selfAssignment/1000000", steps, [&] {
+        Graph c = chain(steps);
+        c.tape->compute(&c.output);
+        c.tape->gradient(c.output, c.input);
+    });
+
+    // the same recurrence recorded once and run as a loop node
+    bench("loop/1000000", steps, [&] {
+        TapePtr<double> t(new Tape<double>());
+        Variable<double> x(1, t);
+        auto out = loop(x, steps, [](Variable<double> &state) {
+            return state * 1.000001;
+        });
+
+        t->compute(&out);
+        t->gradient(out, x);
+    });
+}
+
+// compiled against interpreted, both redoing the whole graph each time
+void jitBenchmarks() {
+    const int width = 1000;
+    Graph d = diamond(width);
+
+    auto compiled = compileTape(*d.tape, d.output);
+    if (!compiled) {
+        cerr << "compileTape failed, skipping jit benchmarks" << endl;
+        return;
+    }
+
+    bench("jit/diamond/1000/compute", width, [&] { compiled->compute(); });
+    bench("jit/diamond/1000/gradient", width, [&] {
+        compiled->compute();
+        compiled->gradient(d.input);
+    });
+    bench("interpreted/diamond/1000/gradient", width, [&] {
+        d.input.setValue(d.input.getValue());
+        d.tape->compute(&d.output);
+        d.tape->gradient(d.output, d.input);
+    });
+}
+
+// tapes/sec with every thread building and differentiating its own small
+// tapes, once with the shared_ptr Tape and once with LocalTape
+void tapeBenchmarks() {
+    const int tapesPerThread = 1000;
+    const int steps = 16;
+
+    auto parallel = [](int threads, auto work) {
+        vector<thread> workers;
+        for (int i = 0; i < threads; i++) {
+            workers.emplace_back(work);
+        }
+        for (thread &worker : workers) {
+            worker.join();
+        }
+    };
+
+    int maxThreads = max(1u, thread::hardware_concurrency());
+    for (int threads = 1; threads <= maxThreads; threads *= 2) {
+        long long tapes = (long long)threads * tapesPerThread;
+
+        bench("tapes/shared/threads=" + to_string(threads), tapes, [&] {
+            parallel(threads, [&] {
+                for (int i = 0; i < tapesPerThread; i++) {
+                    TapePtr<double> t(new Tape<double>());
+                    Variable<double> x(1.5, t);
+                    Variable<double> y = x;
+                    for (int j = 0; j < steps; j++) {
+                        y = y * x + 0.5;
+                    }
+
+                    // LocalTape evaluates while recording, this tape only
+                    // when asked
+                    t->compute(&y);
+                    t->gradient(y, x);
+                }
+            });
+        });
+
+        bench("tapes/local/threads=" + to_string(threads), tapes, [&] {
+            parallel(threads, [&] {
+                LocalTape<double> t;
+                for (int i = 0; i < tapesPerThread; i++) {
+                    t.clear();
+                    auto x = t.variable(1.5);
+                    auto y = x;
+                    for (int j = 0; j < steps; j++) {
+                        y = y * x + 0.5;
+                    }
+
+                    t.gradient(y, x);
+                }
+            });
+        });
+    }
+}
+
+// a classification head over 32 rows of 1000 logits, as one fused
+// crossEntropy node against the same loss built from scalar nodes: each row
+// shifted by its max, log sum exp and the label's term, averaged over rows
+void fusedBenchmarks() {
+    const int rows = 32;
+    const int classes = 1000;
+    const int n = rows * classes;
+
+    vector<double> logits(n);
+    fillUniform(logits.data(), n, -1, 1, 3, 1);
+    vector<int> labels(rows);
+    for (int r = 0; r < rows; r++) {
+        labels[r] = (r * 37) % classes;
+    }
+
+    LocalTape<double> t;
+    auto fused = [&] {
+        t.clear();
+        auto x = t.variable(logits);
+        auto loss = crossEntropy(x, labels);
+        t.backward(loss);
+
+        return loss.getValue();
+    };
+
+    // the max is a constant shift, crossEntropy passes no gradient through
+    // it either
+    auto scalar = [&] {
+        t.clear();
+        auto e = t.variable(M_E);
+        auto loss = t.variable(0);
+        for (int r = 0; r < rows; r++) {
+            const double *row = &logits[r * classes];
+            auto max = t.variable(*max_element(row, row + classes));
+
+            auto sum = t.variable(0);
+            auto picked = sum;
+            for (int j = 0; j < classes; j++) {
+                auto shifted = t.variable(row[j]) - max;
+                sum = sum + (e ^ shifted);
+                if (j == labels[r]) {
+                    picked = shifted;
+                }
+            }
+            loss = loss + (log(sum) - picked);
+        }
+        loss = loss / t.variable(rows);
+        t.backward(loss);
+
+        return loss.getValue();
+    };
+
+    double difference = fabs(fused() - scalar());
+    if (difference > 1e-9) {
+        cerr << "head: scalar loss differs from fused by " << difference
+             << endl;
+    }
+
+    bench("head/fused/32x1000", n, [&] { fused(); });
+    bench("head/scalar/32x1000", n, [&] { scalar(); });
+}
+
+// direct seven-deep loops, the baseline for the im2col path
+void naiveConv2d(const ConvShape &s, const double *x, const double *w,
+                 double *y) {
+    for (int n = 0; n < s.batch; n++) {
+        for (int f = 0; f < s.filters; f++) {
+            for (int oi = 0; oi < s.outH; oi++) {
+                for (int oj = 0; oj < s.outW; oj++) {
+                    double sum = 0;
+                    for (int c = 0; c < s.channels; c++) {
+                        for (int ki = 0; ki < s.kernelH; ki++) {
+                            for (int kj = 0; kj < s.kernelW; kj++) {
+                                int i = oi * s.strideH - s.padH + ki;
+                                int j = oj * s.strideW - s.padW + kj;
+                                if (i < 0 || i >= s.height || j < 0 ||
+                                    j >= s.width) {
+                                    continue;
+                                }
+
+                                int xi = ((n * s.channels + c) * s.height + i) *
+                                             s.width + j;
+                                int wi = ((f * s.channels + c) * s.kernelH +
+                                          ki) * s.kernelW + kj;
+                                sum += x[xi] * w[wi];
+                            }
+                        }
+                    }
+                    *y++ = sum;
+                }
+            }
+        }
+    }
+}
+
+// gradients of sum(g * y) for x and w, same loops as naiveConv2d
+void naiveConv2dBackward(const ConvShape &s, const double *x, const double *w,
+                         const double *g, double *gx, double *gw) {
+    for (int n = 0; n < s.batch; n++) {
+        for (int f = 0; f < s.filters; f++) {
+            for (int oi = 0; oi < s.outH; oi++) {
+                for (int oj = 0; oj < s.outW; oj++, g++) {
+                    for (int c = 0; c < s.channels; c++) {
+                        for (int ki = 0; ki < s.kernelH; ki++) {
+                            for (int kj = 0; kj < s.kernelW; kj++) {
+                                int i = oi * s.strideH - s.padH + ki;
+                                int j = oj * s.strideW - s.padW + kj;
+                                if (i < 0 || i >= s.height || j < 0 ||
+                                    j >= s.width) {
+                                    continue;
+                                }
+
+                                int xi = ((n * s.channels + c) * s.height + i) *
+                                             s.width + j;
+                                int wi = ((f * s.channels + c) * s.kernelH +
+                                          ki) * s.kernelW + kj;
+                                gx[xi] += *g * w[wi];
+                                gw[wi] += *g * x[xi];
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// a 3x3 layer over a batch of 8 16-channel 32x32 images into 32 filters.
+// items are multiply-adds of the forward pass
+void convBenchmarks() {
+    ConvShape shape = conv2dShape(8, 16, 32, 32, 32, 3, 1, 1);
+    long long macs = (long long)shape.outputSize() * shape.patchSize();
+
+    vector<double> x(shape.inputSize()), w(shape.weightSize());
+    vector<double> y(shape.outputSize()), g(shape.outputSize(), 1);
+    vector<double> gx(x.size()), gw(w.size());
+    fillUniform(x.data(), x.size(), -1, 1, 1, 1);
+    fillUniform(w.data(), w.size(), -1, 1, 2, 1);
+
+    bench("conv2d/naive/forward", macs,
+          [&] { naiveConv2d(shape, x.data(), w.data(), y.data()); });
+    bench("conv2d/naive/backward", macs, [&] {
+        naiveConv2dBackward(shape, x.data(), w.data(), g.data(), gx.data(),
+                            gw.data());
+    });
+
+    LocalTape<double> t;
+    auto xv = t.variable(x);
+    auto wv = t.variable(w);
+    auto yv = conv2d(xv, wv, shape);
+    auto loss = crossEntropy(yv, {0});
+
+    bench("conv2d/im2col/forward", macs, [&] { t.compute(); });
+    bench("conv2d/im2col/backward", macs, [&] { t.backward(loss); });
+}
+
+// one training step over a batch of 256 lookups into a 262144 x 32 table,
+// sparse against materializing a table-sized gradient
+void embeddingBenchmarks() {
+    const int rows = 1 << 18;
+    const int batch = 256;
+
+    Matrix<double> table(rows, 32);
+    fillUniform(table.getData(), rows * 32, -1, 1, 4, 1);
+
+    vector<int> ids(batch), labels(batch);
+    for (int k = 0; k < batch; k++) {
+        ids[k] = (k * 7919) % rows;
+        labels[k] = k % 32;
+    }
+
+    LocalTape<double> t;
+    auto loss = crossEntropy(t.gather(table, ids), labels);
+
+    bench("embedding/sparse/sgd", batch, [&] {
+        t.compute();
+        t.backward(loss);
+        sgdUpdate(table, t.sparseGradient(table), 0.01);
+    });
+
+    Matrix<double> dense(rows, 32);
+    bench("embedding/dense/sgd", batch, [&] {
+        t.compute();
+        t.backward(loss);
+
+        SparseGradient<double> grad = t.sparseGradient(table);
+        fill(dense.getData(), dense.getData() + rows * 32, 0);
+        for (int k = 0; k < grad.size(); k++) {
+            copy(grad.row(k), grad.row(k) + 32, &dense(grad.rows[k], 0));
+        }
+
+        double *data = table.getData();
+        for (int i = 0; i < rows * 32; i++) {
+            data[i] -= 0.01 * dense.getData()[i];
+        }
+    });
+}
+
+// a two-layer classifier trained with sgd, one worker per shard of the
+// batch. layers are 1x1 convolutions over 1x1 images, i.e. dense layers
+struct Classifier {
+    static const int inputs = 64;
+    static const int hidden = 256;
+    static const int classes = 10;
+    static const int batch = 512;
+
+    vector<double> data;
+    vector<int> labels;
+    vector<vector<double>> initial;
+
+    Classifier() : data(batch * inputs), labels(batch) {
+        fillUniform(data.data(), data.size(), -1, 1, 5, 1);
+        for (int k = 0; k < batch; k++) {
+            labels[k] = k % classes;
+        }
+
+        initial = {vector<double>(hidden * inputs), vector<double>(hidden),
+                   vector<double>(classes * hidden), vector<double>(classes)};
+        xavierUniform(initial[0].data(), initial[0].size(), inputs, hidden, 6,
+                      1);
+        xavierUniform(initial[2].data(), initial[2].size(), hidden, classes,
+                      7, 1);
+    }
+
+    // trains on rows [rank * batch / workers, ...) and leaves the
+    // parameters in params. gradients are averaged through comm as the
+    // backward pass produces them. false if the averaging failed
+    bool train(ShmCommunicator &comm, int steps,
+               vector<vector<double>> &params) {
+        int rows = batch / comm.getWorkers();
+        int first = comm.getRank() * rows;
+
+        LocalTape<double> t;
+        auto x = t.variable(vector<double>(data.begin() + first * inputs,
+                                           data.begin() +
+                                               (first + rows) * inputs));
+
+        // each layer's parameters are recorded right before it, so the
+        // backward pass finishes them one layer at a time
+        params = initial;
+        vector<LocalVariable<double>> vars;
+        for (auto &p : params) {
+            vars.push_back(t.variable(p));
+            if (vars.size() == 2) {
+                x = tanh(conv2d(x, vars[0], vars[1],
+                                conv2dShape(rows, inputs, 1, 1, hidden, 1)));
+            }
+        }
+
+        auto logits = conv2d(x, vars[2], vars[3],
+                             conv2dShape(rows, hidden, 1, 1, classes, 1));
+        auto loss = crossEntropy(
+            logits, vector<int>(labels.begin() + first,
+                                labels.begin() + first + rows));
+
+        vector<vector<double>> grads;
+        for (auto &p : params) {
+            grads.emplace_back(p.size());
+        }
+
+        GradientBuckets buckets(comm, 4096);
+        for (int step = 0; step < steps; step++) {
+            for (size_t p = 0; p < params.size(); p++) {
+                t.setValues(vars[p], params[p]);
+            }
+            t.compute();
+
+            t.backward(loss, [&](int index) {
+                for (size_t p = 0; p < vars.size(); p++) {
+                    if (vars[p].getIndex() == index) {
+                        buckets.add(t.getAdjoints(vars[p]), grads[p].data(),
+                                    params[p].size());
+                    }
+                }
+            });
+            if (!buckets.finish()) {
+                return false;
+            }
+
+            for (size_t p = 0; p < params.size(); p++) {
+                for (size_t i = 0; i < params[p].size(); i++) {
+                    params[p][i] -= 0.1 * grads[p][i];
+                }
+            }
+        }
+
+        return true;
+    }
+};
+
+// trains the same steps with 1, 2, 4 ... workers, checks the parameters
+// against a single process and reports scaling efficiency on stderr. items
+// are training samples
+void dataParallelBenchmarks() {
+    const int steps = 20;
+    int maxWorkers = max(2u, thread::hardware_concurrency());
+
+    // the reference run is slow, skip it when every case is filtered out
+    bool selected = false;
+    for (int workers = 1; workers <= maxWorkers; workers *= 2) {
+        string name = "dataparallel/workers=" + to_string(workers);
+        selected = selected || filter.empty() ||
+                   name.find(filter) != string::npos;
+    }
+    if (!selected) {
+        return;
+    }
+
+    Classifier model;
+
+    vector<vector<double>> reference;
+    // e.g. no /dev/shm in a sandbox
+    auto single = ShmCommunicator::create(1, 1);
+    if (!single) {
+        cerr << "dataparallel: no shared memory, skipped" << endl;
+        return;
+    }
+    model.train(*single, steps, reference);
+
+    size_t count = 0;
+    for (auto &p : reference) {
+        count += p.size();
+    }
+
+    double baseline = 0;
+    for (int workers = 1; workers <= maxWorkers; workers *= 2) {
+        shared_ptr<double> result = sharedArray(count);
+        bool ok = result != nullptr;
+
+        string name = "dataparallel/workers=" + to_string(workers);
+        bench(name, (long long)steps * Classifier::batch, [&] {
+            auto comm = ShmCommunicator::create(workers, 1 << 16);
+            ok = ok && comm && runWorkers(workers, [&](int rank) {
+                comm->setRank(rank);
+
+                vector<vector<double>> params;
+                if (!model.train(*comm, steps, params)) {
+                    comm->abort();
+                    return 1;
+                }
+
+                if (rank == 0) {
+                    double *out = result.get();
+                    for (auto &p : params) {
+                        out = copy(p.begin(), p.end(), out);
+                    }
+                }
+                return 0;
+            });
+        });
+
+        if (results.empty() || results.back().name != name) {
+            continue;
+        }
+
+        double difference = ok ? 0 : INFINITY;
+        const double *out = result.get();
+        for (auto &p : reference) {
+            for (size_t i = 0; ok && i < p.size(); i++) {
+                difference = max(difference, fabs(*out++ - p[i]));
+            }
+        }
+
+        Result &r = results.back();
+        double perIteration = r.seconds / r.iterations;
+        baseline = workers == 1 ? perIteration : baseline;
+
+        cerr << name << ": max difference from one process " << difference;
+        if (baseline > 0) {
+            cerr << ", scaling efficiency "
+                 << baseline / (workers * perIteration);
+        }
+        cerr << endl;
+    }
+}
+
+// the i-j-k loops matmul used before it went through gemm, so matmul/N
+// keeps measuring the same kernel across runs
+Matrix<double> naiveMatmul(const Matrix<double> &m1,
+                           const Matrix<double> &m2) {
+    Matrix<double> m3(m1.rows, m2.cols);
+
+    for (int i = 0; i < m3.rows; i++) {
+        for (int j = 0; j < m3.cols; j++) {
+            for (int k = 0; k < m1.cols; k++) {
+                m3(i, j) += m1(i, k) * m2(k, j);
+            }
+        }
+    }
+
+    return m3;
+}
+
+void matmulBenchmarks() {
+    for (int n : {32, 64, 128, 256}) {
+        Matrix<double> a(n, n), b(n, n);
+        fillUniform(a.getData(), n * n, -1, 1, 1, 1);
+        fillUniform(b.getData(), n * n, -1, 1, 2, 1);
+
+        bench("matmul/" + to_string(n), (long long)n * n * n,
+              [&] { naiveMatmul(a, b); });
+        bench("gemm/" + to_string(n), (long long)n * n * n,
+              [&] { matmul(a, b); });
+    }
+}
+
+void rngBenchmarks() {
+    const int n = 1 << 20;
+    vector<double> data(n);
+
+    bench("rng/marsagliaPolar", n, [&] {
+        for (int i = 0; i < n; i++) {
+            data[i] = marsagliaPolar();
+        }
+    });
+    bench("rng/fillNormal/1thread", n,
+          [&] { fillNormal(data.data(), n, 0, 1, 42, 1); });
+    bench("rng/fillNormal/allthreads", n,
+          [&] { fillNormal(data.data(), n, 0, 1, 42, 0); });
+    bench("rng/heUniform/allthreads", n,
+          [&] { heUniform(data.data(), n, 512, 42, 0); });
+}
+
+int main(int argc, char **argv) {
+    bool json = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            json = true;
+        } else if (strncmp(argv[i], "--filter=", 9) == 0) {
+            filter = argv[i] + 9;
+        } else if (strncmp(argv[i], "--min-time=", 11) == 0) {
+            minSeconds = atof(argv[i] + 11);
+        } else {
+            cerr << "usage: " << argv[0]
+                 << " [--json] [--filter=substring] [--min-time=seconds]"
+                 << endl;
+            return 1;
+        }
+    }
+
+    graphBenchmarks();
+    jitBenchmarks();
+    tapeBenchmarks();
+    fusedBenchmarks();
+    convBenchmarks();
+    embeddingBenchmarks();
+    dataParallelBenchmarks();
+    matmulBenchmarks();
+    rngBenchmarks();
+
+    if (json) {
+        printJson();
+    } else {
+        printTable();
+    }
+
+    return 0;
+}
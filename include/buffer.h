@@ -4,13 +4,31 @@
 #include <cstdlib>
 #include <memory>
 
+// a single value. by default it lives inside the Buffer itself, so creating
+// one is a single allocation, shared with its control block and taken from
+// the tape's pool. storage owned elsewhere is kept alive through owner
 template <typename T>
 class Buffer {
-    std::shared_ptr<T> value;
+    T local;
+    T *value;
+    std::shared_ptr<T> owner;
 
   public:
-    Buffer() {
-        value = std::shared_ptr<T>(new T);
+    Buffer() : local(), value(&local) {}
+
+    // uses storage owned elsewhere (e.g. a mapped file) without copying
+    Buffer(std::shared_ptr<T> storage)
+        : local(), value(storage.get()), owner(std::move(storage)) {}
+
+    // value may point into this object
+    Buffer(const Buffer<T> &) = delete;
+    Buffer<T> &operator=(const Buffer<T> &) = delete;
+
+    // moves the value into new storage, e.g. a slot assigned by a memory plan
+    void rebind(std::shared_ptr<T> storage) {
+        *storage = *value;
+        value = storage.get();
+        owner = std::move(storage);
     }
 
     T getValue() {
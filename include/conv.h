@@ -0,0 +1,265 @@
+#ifndef CONV
+#define CONV
+
+#include <algorithm>
+#include <cassert>
+#include <vector>
+
+#include "mat_operations.h"
+
+// spatial kernels over raw row-major arrays
+//
+// inputs are batch x channels x height x width, weights filters x channels x
+// kernelH x kernelW. a convolution unrolls every receptive field of one
+// sample into a column (im2col) and multiplies the filters against the
+// result with gemm. the backward pass redoes the unrolling instead of
+// keeping it, so the scratch space is one sample's worth
+struct ConvShape {
+    int batch;
+    int channels;
+    int height;
+    int width;
+
+    int filters;  // equal to channels for pooling
+    int kernelH;
+    int kernelW;
+    int strideH;
+    int strideW;
+    int padH;
+    int padW;
+
+    int outH;
+    int outW;
+
+    int inputSize() const {
+        return batch * channels * height * width;
+    }
+    int weightSize() const {
+        return filters * channels * kernelH * kernelW;
+    }
+    int outputSize() const {
+        return batch * filters * outH * outW;
+    }
+
+    // rows and columns of one sample's unrolled input
+    int patchSize() const {
+        return channels * kernelH * kernelW;
+    }
+    int positions() const {
+        return outH * outW;
+    }
+};
+
+inline ConvShape makeConvShape(int batch, int channels, int height, int width,
+                               int filters, int kernelH, int kernelW,
+                               int strideH, int strideW, int padH, int padW) {
+    int outH = (height + 2 * padH - kernelH) / strideH + 1;
+    int outW = (width + 2 * padW - kernelW) / strideW + 1;
+    // the kernel has to fit inside the padded input
+    assert(outH > 0 && outW > 0);
+
+    ConvShape s = {batch,   channels, height,  width, filters, kernelH,
+                   kernelW, strideH,  strideW, padH,  padW,    outH,
+                   outW};
+
+    return s;
+}
+
+inline ConvShape conv2dShape(int batch, int channels, int height, int width,
+                             int filters, int kernel, int stride = 1,
+                             int pad = 0) {
+    return makeConvShape(batch, channels, height, width, filters, kernel,
+                         kernel, stride, stride, pad, pad);
+}
+
+// a 1d convolution is a 2d one over a single row
+inline ConvShape conv1dShape(int batch, int channels, int width, int filters,
+                             int kernel, int stride = 1, int pad = 0) {
+    return makeConvShape(batch, channels, 1, width, filters, 1, kernel, 1,
+                         stride, 0, pad);
+}
+
+inline ConvShape pool2dShape(int batch, int channels, int height, int width,
+                             int kernel, int stride) {
+    return makeConvShape(batch, channels, height, width, channels, kernel,
+                         kernel, stride, stride, 0, 0);
+}
+
+inline ConvShape pool1dShape(int batch, int channels, int width, int kernel,
+                             int stride) {
+    return makeConvShape(batch, channels, 1, width, channels, 1, kernel, 1,
+                         stride, 0, 0);
+}
+
+// cols is patchSize() x positions(), zero where the field hangs over the
+// padding
+template <typename T>
+void im2col(const ConvShape &s, const T *x, T *cols) {
+    for (int c = 0; c < s.channels; c++) {
+        for (int ki = 0; ki < s.kernelH; ki++) {
+            for (int kj = 0; kj < s.kernelW; kj++) {
+                for (int oi = 0; oi < s.outH; oi++) {
+                    int i = oi * s.strideH - s.padH + ki;
+                    if (i < 0 || i >= s.height) {
+                        cols = std::fill_n(cols, s.outW, T(0));
+                        continue;
+                    }
+
+                    const T *row = x + (c * s.height + i) * s.width;
+                    for (int oj = 0; oj < s.outW; oj++) {
+                        int j = oj * s.strideW - s.padW + kj;
+                        *cols++ = j >= 0 && j < s.width ? row[j] : 0;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// adds every column entry back onto the input position it was read from
+template <typename T>
+void col2im(const ConvShape &s, const T *cols, T *gx) {
+    for (int c = 0; c < s.channels; c++) {
+        for (int ki = 0; ki < s.kernelH; ki++) {
+            for (int kj = 0; kj < s.kernelW; kj++) {
+                for (int oi = 0; oi < s.outH; oi++) {
+                    int i = oi * s.strideH - s.padH + ki;
+                    if (i < 0 || i >= s.height) {
+                        cols += s.outW;
+                        continue;
+                    }
+
+                    T *row = gx + (c * s.height + i) * s.width;
+                    for (int oj = 0; oj < s.outW; oj++, cols++) {
+                        int j = oj * s.strideW - s.padW + kj;
+                        if (j >= 0 && j < s.width) {
+                            row[j] += *cols;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// bias may be null
+template <typename T>
+void conv2d(const ConvShape &s, const T *x, const T *w, const T *bias, T *y,
+            std::vector<T> &scratch) {
+    int sampleIn = s.channels * s.height * s.width;
+    int sampleOut = s.filters * s.positions();
+    scratch.resize(s.patchSize() * s.positions());
+
+    for (int n = 0; n < s.batch; n++, x += sampleIn, y += sampleOut) {
+        im2col(s, x, scratch.data());
+
+        for (int f = 0; f < s.filters; f++) {
+            std::fill(y + f * s.positions(), y + (f + 1) * s.positions(),
+                      bias ? bias[f] : 0);
+        }
+
+        gemm(w, scratch.data(), y, s.filters, s.positions(), s.patchSize());
+    }
+}
+
+// accumulates into gx, gw and gb given the output adjoints g. gb may be null
+template <typename T>
+void conv2dBackward(const ConvShape &s, const T *x, const T *w, const T *g,
+                    T *gx, T *gw, T *gb, std::vector<T> &scratch) {
+    int sampleIn = s.channels * s.height * s.width;
+    int sampleOut = s.filters * s.positions();
+    int patches = s.patchSize() * s.positions();
+    scratch.resize(2 * patches);
+
+    T *cols = scratch.data();
+    T *gcols = cols + patches;
+
+    for (int n = 0; n < s.batch;
+         n++, x += sampleIn, gx += sampleIn, g += sampleOut) {
+        // gw += g * cols^T
+        im2col(s, x, cols);
+        gemm(g, cols, gw, s.filters, s.patchSize(), s.positions(), false,
+             true);
+
+        // gx += col2im(w^T * g)
+        std::fill(gcols, gcols + patches, 0);
+        gemm(w, g, gcols, s.patchSize(), s.positions(), s.filters, true);
+        col2im(s, gcols, gx);
+
+        if (gb) {
+            for (int f = 0; f < s.filters; f++) {
+                const T *gf = g + f * s.positions();
+                for (int p = 0; p < s.positions(); p++) {
+                    gb[f] += gf[p];
+                }
+            }
+        }
+    }
+}
+
+// max or average over every window, per channel. padding is not supported
+template <typename T>
+void pool2d(const ConvShape &s, bool max, const T *x, T *y) {
+    T scale = (T)1 / (s.kernelH * s.kernelW);
+
+    for (int plane = 0; plane < s.batch * s.channels; plane++) {
+        const T *xp = x + plane * s.height * s.width;
+
+        for (int oi = 0; oi < s.outH; oi++) {
+            for (int oj = 0; oj < s.outW; oj++) {
+                const T *window =
+                    xp + oi * s.strideH * s.width + oj * s.strideW;
+
+                T result = max ? window[0] : 0;
+                for (int ki = 0; ki < s.kernelH; ki++) {
+                    for (int kj = 0; kj < s.kernelW; kj++) {
+                        T v = window[ki * s.width + kj];
+                        result = max ? std::max(result, v) : result + v;
+                    }
+                }
+
+                *y++ = max ? result : result * scale;
+            }
+        }
+    }
+}
+
+// max routes each adjoint to the first maximum of its window, found again
+// from x
+template <typename T>
+void pool2dBackward(const ConvShape &s, bool max, const T *x, const T *g,
+                    T *gx) {
+    T scale = (T)1 / (s.kernelH * s.kernelW);
+
+    for (int plane = 0; plane < s.batch * s.channels; plane++) {
+        int offset = plane * s.height * s.width;
+
+        for (int oi = 0; oi < s.outH; oi++) {
+            for (int oj = 0; oj < s.outW; oj++, g++) {
+                int base = offset + oi * s.strideH * s.width + oj * s.strideW;
+
+                if (!max) {
+                    for (int ki = 0; ki < s.kernelH; ki++) {
+                        for (int kj = 0; kj < s.kernelW; kj++) {
+                            gx[base + ki * s.width + kj] += *g * scale;
+                        }
+                    }
+                    continue;
+                }
+
+                int best = base;
+                for (int ki = 0; ki < s.kernelH; ki++) {
+                    for (int kj = 0; kj < s.kernelW; kj++) {
+                        int index = base + ki * s.width + kj;
+                        if (x[index] > x[best]) {
+                            best = index;
+                        }
+                    }
+                }
+                gx[best] += *g;
+            }
+        }
+    }
+}
+
+#endif
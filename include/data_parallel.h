@@ -0,0 +1,122 @@
+#ifndef DATA_PARALLEL
+#define DATA_PARALLEL
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// data-parallel training across forked worker processes on one machine
+//
+// ShmCommunicator maps a POSIX shared memory segment that every worker
+// inherits through fork. allReduce sums a buffer across the workers with a
+// ring: the buffer is cut into one chunk per worker, a reduce-scatter leaves
+// each worker holding one fully summed chunk and an all-gather passes the
+// sums around. at every step a worker only reads its left neighbour's slot,
+// ordered by per-worker step counters, so no locks are taken
+//
+// GradientBuckets packs gradients into buckets as a backward pass finishes
+// them and averages full buckets on a background thread while the pass goes
+// on
+class ShmCommunicator {
+    struct Counter;
+    struct Control;
+
+    void *memory;
+    size_t bytes;
+    int workers;
+    int rank;
+    size_t capacity;  // doubles per slot
+
+    Control *control;
+    Counter *counters;
+    double *slots;
+    uint64_t step;  // steps this worker has completed
+
+    ShmCommunicator() = default;
+
+    bool aborted();
+    bool waitFor(int worker, int64_t steps);
+    void advance();
+    bool reducePiece(double *data, size_t count);
+
+  public:
+    // one slot of capacity doubles per worker. the step counters only move
+    // forward, so a communicator serves a single group of forked workers.
+    // nullptr if the segment can't be created
+    static std::unique_ptr<ShmCommunicator> create(int workers,
+                                                   size_t capacity);
+    ~ShmCommunicator();
+
+    ShmCommunicator(const ShmCommunicator &) = delete;
+    ShmCommunicator &operator=(const ShmCommunicator &) = delete;
+
+    // called in each worker after fork, before the first allReduce
+    void setRank(int rank);
+
+    int getRank() {
+        return rank;
+    }
+    int getWorkers() {
+        return workers;
+    }
+
+    // every worker has to call this with the same count, in the same order.
+    // buffers larger than the slots go round in pieces. false, with data
+    // left half reduced, once any worker has aborted
+    bool allReduce(double *data, size_t count);
+
+    // a worker that gives up calls this so the others stop waiting for it
+    void abort();
+};
+
+class GradientBuckets {
+    struct Bucket {
+        std::vector<double> values;
+        std::vector<std::pair<double *, size_t>> outputs;
+    };
+
+    ShmCommunicator &comm;
+    size_t bucketSize;
+    Bucket current;
+
+    std::deque<Bucket> queue;
+    int pending;
+    bool failed;
+    bool stopping;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable drained;
+    std::thread reducer;
+
+    void run();
+    void flush();
+
+  public:
+    GradientBuckets(ShmCommunicator &comm, size_t bucketSize);
+    ~GradientBuckets();
+
+    // grad is copied in right away. out receives the average over all
+    // workers and must not be touched until finish returns
+    void add(const double *grad, double *out, size_t count);
+
+    // sends the last partial bucket and waits for every bucket to land.
+    // false if a reduction failed since the buckets were made, the outputs
+    // are not all written then
+    bool finish();
+};
+
+// forks one process per worker and calls body(rank) in each, the exit
+// status is its return value. true if every worker returned 0. the first
+// worker to fail or die gets the others killed
+bool runWorkers(int workers, const std::function<int(int)> &body);
+
+// memory a parent and its forked workers all see, zero initialized
+std::shared_ptr<double> sharedArray(size_t n);
+
+#endif
@@ -1,8 +1,31 @@
 #ifndef GENERATION
 #define GENERATION
+#include <cstddef>
+#include <cstdint>
 #include <cstdlib>
 
 int randBinary();
 double marsagliaPolar();
 
+// parallel initializers for large parameter arrays
+//
+// the output is split into fixed-size blocks and every block draws from its
+// own substream seeded from (seed, block index), so the values written are
+// bitwise identical no matter how many threads do the work.
+// threads <= 0 uses every available core
+
+void fillUniform(double *data, size_t n, double low, double high,
+                 uint64_t seed, int threads = 0);
+void fillNormal(double *data, size_t n, double mean, double stddev,
+                uint64_t seed, int threads = 0);
+
+void xavierUniform(double *data, size_t n, int fanIn, int fanOut,
+                   uint64_t seed, int threads = 0);
+void xavierNormal(double *data, size_t n, int fanIn, int fanOut,
+                  uint64_t seed, int threads = 0);
+void heUniform(double *data, size_t n, int fanIn, uint64_t seed,
+               int threads = 0);
+void heNormal(double *data, size_t n, int fanIn, uint64_t seed,
+              int threads = 0);
+
 #endif
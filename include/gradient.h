@@ -3,13 +3,17 @@
 
 #include <assert.h>
 
+#include <algorithm>
+#include <deque>
 #include <memory>
 #include <stack>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#include "node_pool.h"
 #include "ops.h"
+#include "profiler.h"
 #include "variable.h"
 
 template <typename T>
@@ -30,23 +34,40 @@ using GradNodePtr = std::shared_ptr<GradNode<T>>;
 template <typename T>
 using OpPtr = std::shared_ptr<Operation<T>>;
 
+// a tape node's edges and consumers, stored in the tape's pool
+template <typename T>
+using EdgeList = std::vector<NodePtr<T>, PoolAllocator<NodePtr<T>>>;
+using ConsumerList = std::vector<int, PoolAllocator<int>>;
+
 template <typename T>
 class Node {
     int id;
     OpPtr<T> op;
 
+    // set while the output may be out of date with respect to the inputs
+    bool dirty;
+
   public:
-    Node(int id, OpPtr<T> op) : id(id), op(op) {}
+    Node(int id, OpPtr<T> op) : id(id), op(std::move(op)), dirty(true) {}
 
     int getId() {
         return id;
     }
+    bool isDirty() {
+        return dirty;
+    }
+    void setDirty(bool dirty) {
+        this->dirty = dirty;
+    }
     OpPtr<T> getOp() {
         return op;
     }
     bool isConstant() {
         return op->isConstant();
     }
+    OpCode getOpCode() {
+        return op->getOpCode();
+    }
 
     void compute() {
         op->compute();
@@ -88,6 +109,9 @@ class GradNode {
     bool isConstant() {
         return op->isConstant();
     }
+    OpCode getOpCode() {
+        return op->getOpCode();
+    }
 };
 
 template <typename T>
@@ -134,9 +158,15 @@ class GradSubgraph {
         headId = idMap[id];
     }
 
-    T computeGradient() {
+    // per-op backward times are recorded when a profiler is given
+    T computeGradient(Profiler *profiler = nullptr) {
         using P = std::pair<GradNodePtr<T>, int>;
 
+        // the target doesn't depend on wrt
+        if (nodes.empty()) {
+            return 0;
+        }
+
         // TODO: ensure graph is acyclic/accommodate cycles
         //
         // in-order depth-first traversal to calculate up from constants
@@ -169,12 +199,22 @@ class GradSubgraph {
                     prevNode = edgeMap[id][0];
                 }
 
+                Profiler::Clock::time_point start;
+                if (profiler) {
+                    start = Profiler::Clock::now();
+                }
+
                 if (node->isConstant()) {
                     node->setConstantGradValue(wrtId, prevNode);
                 } else {
                     node->setGradValue(du, dv);
                 }
 
+                if (profiler) {
+                    profiler->recordBackward(node->getOpCode(), start,
+                                             Profiler::Clock::now());
+                }
+
                 s.pop();
             } else {
                 s.emplace(edgeMap[id][index++], 0);
@@ -186,6 +226,10 @@ class GradSubgraph {
         return edgeMap[headId][0]->getGradValue();
     }
 
+    int getNodeCount() {
+        return nodes.size();
+    }
+
     void setWrt(int id) {
         assert(idMap.find(id) != idMap.end());
         wrtId = idMap[id];
@@ -203,41 +247,158 @@ class GradSubgraph {
 };
 
 // graph that holds all the operations conducted for gradient calculation
+//
+// compute is incremental: new nodes, nodes given new edges and Variables
+// written through setValue are marked dirty along with everything computed
+// from them, and compute only re-runs dirty nodes under its target.
+// gradients are cached per (target, wrt) until the target turns dirty
+//
+// with a horizon > 0 the tape runs in streaming mode: once more than
+// `horizon` nodes are live the oldest ones are retired and their storage is
+// recycled. edges into retired nodes are no longer followed, so their values
+// stay frozen at whatever they last held and gradients stop there
+// (truncated backprop). compute results before they fall out of the window.
+// a retired Variable still held outside the tape can be written through
+// setValue, which marks the live nodes reading it dirty
 template <typename T>
 class Tape {
-    std::vector<NodePtr<T>> nodes;
-    std::vector<std::vector<NodePtr<T>>> edgeMap;
+    template <typename U>
+    using PoolDeque = std::deque<U, PoolAllocator<U>>;
+
+    // nodes, operations, buffers and edge lists recorded here
+    NodePool *pool;
+
+    PoolDeque<NodePtr<T>> nodes;
+    PoolDeque<EdgeList<T>> edgeMap;
+
+    // reverse edges, consumers[id] holds every node with an edge to id
+    PoolDeque<ConsumerList> consumers;
+
+    // target id -> wrt id -> gradient, only for clean targets
+    std::unordered_map<int, std::unordered_map<int, T>> gradCache;
 
     int idCount;
 
+    int horizon;
+    int baseId;  // id of nodes.front()
+
+    // retired nodes whose buffers are still referenced outside the tape
+    // (e.g. parameters held by a Variable), kept without their edges so new
+    // operations can keep using them
+    std::unordered_map<int, NodePtr<T>> retired;
+    size_t retiredLimit;
+
+    // consumers of the nodes in retired, so a setValue on one still reaches
+    // the live nodes reading it. may name nodes retired since
+    std::unordered_map<int, ConsumerList> retiredConsumers;
+
+    std::vector<EdgeList<T>> spareEdges;
+    std::vector<ConsumerList> spareConsumers;
+    const EdgeList<T> noEdges;
+
+    Profiler profiler;
+
+    bool incremental;
+
+    bool isRetired(int id) {
+        return id < baseId;
+    }
+
+    template <typename V>
+    V takeSpare(std::vector<V> &spares) {
+        if (spares.empty()) {
+            return V(typename V::allocator_type(pool));
+        }
+
+        V spare = std::move(spares.back());
+        spares.pop_back();
+
+        return spare;
+    }
+
+    void retireOldest() {
+        NodePtr<T> node = nodes.front();
+
+        // clear() keeps the capacity for the next node
+        edgeMap.front().clear();
+        spareEdges.push_back(std::move(edgeMap.front()));
+        if (node->isConstant()) {
+            retiredConsumers.insert_or_assign(node->getId(),
+                                              std::move(consumers.front()));
+        } else {
+            consumers.front().clear();
+            spareConsumers.push_back(std::move(consumers.front()));
+        }
+
+        nodes.pop_front();
+        edgeMap.pop_front();
+        consumers.pop_front();
+        gradCache.erase(baseId);
+        baseId++;
+
+        if (node->isConstant()) {
+            retired[node->getId()] = node;
+            if (retired.size() > retiredLimit) {
+                pruneRetired();
+            }
+        }
+    }
+
+    void pruneRetired() {
+        for (auto it = retired.begin(); it != retired.end();) {
+            // the node's own Constant op accounts for two references, any
+            // more means someone can still hand this node to an operation
+            if (it->second->getOp()->getOutput().use_count() <= 2) {
+                retiredConsumers.erase(it->first);
+                it = retired.erase(it);
+            } else {
+                it++;
+            }
+        }
+
+        retiredLimit = std::max((size_t)64, 2 * retired.size());
+    }
+
     GradSubgraph<T> buildGradSubgraph(Variable<T> &target, Variable<T> &wrt) {
-        using P = std::pair<int, std::vector<int>>;
+        using P = std::pair<int, size_t>;
 
+        // dependent nodes lie on some path from target to wrt: reachable
+        // from target and able to reach wrt. each node is settled once, after
+        // all of its edges
         std::unordered_set<int> dependent;
+        std::unordered_map<int, bool> reachesWrt;
         std::stack<P> s;
-        s.emplace(target.getNodeId(), std::vector<int>{});
+        s.emplace(target.getNodeId(), 0);
 
         while (!s.empty()) {
-            auto [nodeId, path] = s.top();
-            s.pop();
+            auto &[nodeId, index] = s.top();
+            const EdgeList<T> &edges = getEdges(nodeId);
 
-            if (nodeId == wrt.getNodeId()) {
-                for (int i = 0; i < path.size(); i++) {
-                    dependent.insert(path[i]);
+            if (index < edges.size()) {
+                int next = edges[index++]->getId();
+                if (reachesWrt.find(next) == reachesWrt.end()) {
+                    s.emplace(next, 0);
                 }
 
-                dependent.insert(nodeId);
+                continue;
             }
 
-            path.push_back(nodeId);
-            for (int i = 0; i < edgeMap[nodeId].size(); i++) {
-                s.emplace(edgeMap[nodeId][i]->getId(), path);
+            bool reaches = nodeId == wrt.getNodeId();
+            for (auto edge : edges) {
+                reaches = reaches || reachesWrt[edge->getId()];
+            }
+
+            reachesWrt[nodeId] = reaches;
+            if (reaches) {
+                dependent.insert(nodeId);
             }
+
+            s.pop();
         }
 
         GradSubgraph<T> graph;
         for (auto id : dependent) {
-            graph.createNode(nodes[id]);
+            graph.createNode(getNode(id));
             if (id == target.getNodeId()) {
                 graph.setHead(id);
             } else if (id == wrt.getNodeId()) {
@@ -246,9 +407,9 @@ class Tape {
         }
 
         for (auto id : dependent) {
-            for (auto edge : edgeMap[id]) {
+            for (auto edge : getEdges(id)) {
                 int edgeId = edge->getId();
-                if (!nodes[id]->isConstant() ||
+                if (!getNode(id)->isConstant() ||
                     dependent.find(edgeId) != dependent.end()) {
                     int from = graph.getIdMapping(id);
                     int to = graph.getIdMapping(edgeId);
@@ -257,12 +418,12 @@ class Tape {
                     // create the node here
                     // TODO: this feels gross. is there a better way to do this?
                     if (from == -1) {
-                        graph.createNode(nodes[id]);
+                        graph.createNode(getNode(id));
                         from = graph.getIdMapping(id);
                     }
 
                     if (to == -1) {
-                        graph.createNode(nodes[edgeId]);
+                        graph.createNode(edge);
                         to = graph.getIdMapping(edgeId);
                     }
 
@@ -275,92 +436,378 @@ class Tape {
     }
 
   public:
-    Tape() : idCount(0) {}
+    Tape() : Tape(0) {}
+
+    // horizon == 0 keeps every node
+    explicit Tape(int horizon)
+        : pool(NodePool::create()),
+          nodes(PoolAllocator<NodePtr<T>>(pool)),
+          edgeMap(PoolAllocator<EdgeList<T>>(pool)),
+          consumers(PoolAllocator<ConsumerList>(pool)),
+          idCount(0),
+          horizon(horizon),
+          baseId(0),
+          retiredLimit(64),
+          noEdges(typename EdgeList<T>::allocator_type(pool)),
+          incremental(true) {
+        // opOverload links a new output node to the op created right after
+        // it, so both must fit in the window
+        assert(horizon == 0 || horizon >= 2);
+    }
+
+    // blocks still held elsewhere keep the pool alive after this
+    ~Tape() {
+        pool->release();
+    }
+
+    Tape(const Tape<T> &) = delete;
+    Tape<T> &operator=(const Tape<T> &) = delete;
 
+    // builds an object in the tape's pool, for what gets recorded on it
+    template <typename U, typename... Args>
+    std::shared_ptr<U> make(Args &&...args) {
+        return std::allocate_shared<U>(PoolAllocator<U>(pool),
+                                       std::forward<Args>(args)...);
+    }
+
+    // number of live nodes
     int getNodeCount() {
         return nodes.size();
     }
 
+    // id of the oldest live node, 0 unless nodes have been retired
+    int getFirstId() {
+        return baseId;
+    }
+
     int getLastId() {
         return idCount - 1;
     }
 
-    void createNode(OpPtr<T> op) {
-        NodePtr<T> node(new Node<T>(idCount++, op));
-        nodes.push_back(node);
+    int getHorizon() {
+        return horizon;
+    }
 
-        // edgeMap must always be length == nodes.size()
-        edgeMap.push_back({});
+    Profiler &getProfiler() {
+        return profiler;
+    }
 
-        assert(nodes.size() == edgeMap.size());
+    NodePtr<T> getNode(int id) {
+        if (isRetired(id)) {
+            auto it = retired.find(id);
+            assert(it != retired.end());
+
+            return it->second;
+        }
+
+        return nodes[id - baseId];
     }
 
-    void createNode(Operation<T> *op) {
-        OpPtr<T> opPtr(op);
-        NodePtr<T> node(new Node<T>(idCount++, opPtr));
-        nodes.push_back(node);
+    // retired nodes have no edges
+    const EdgeList<T> &getEdges(int id) {
+        if (isRetired(id)) {
+            return noEdges;
+        }
+
+        return edgeMap[id - baseId];
+    }
+
+    void createNode(OpPtr<T> op) {
+        nodes.push_back(make<Node<T>>(idCount++, std::move(op)));
+        const NodePtr<T> &node = nodes.back();
 
         // edgeMap must always be length == nodes.size()
-        edgeMap.push_back({});
+        edgeMap.push_back(takeSpare(spareEdges));
+        consumers.push_back(takeSpare(spareConsumers));
+
+        // every operation takes two operands
+        if (!node->isConstant()) {
+            edgeMap.back().reserve(2);
+        }
+
+        if (profiler.isEnabled()) {
+            // approximate: ignores allocator and control block overhead
+            profiler.recordNode(node->getOpCode(),
+                                sizeof(Node<T>) + sizeof(Operation<T>));
+        }
 
         assert(nodes.size() == edgeMap.size());
+
+        while (horizon > 0 && (int)nodes.size() > horizon) {
+            retireOldest();
+        }
+    }
+
+    void createNode(Operation<T> *op) {
+        createNode(OpPtr<T>(op));
     }
 
     void addEdge(int from, int to) {
-        edgeMap[from].push_back(nodes[to]);
+        assert(!isRetired(from));
+
+        edgeMap[from - baseId].push_back(getNode(to));
+        if (!isRetired(to)) {
+            consumers[to - baseId].push_back(from);
+        } else {
+            // a parameter used every step gains a consumer every step, drop
+            // the retired ones before the list grows
+            ConsumerList &list =
+                retiredConsumers
+                    .try_emplace(to, ConsumerList::allocator_type(pool))
+                    .first->second;
+            if (list.size() == list.capacity()) {
+                list.erase(std::remove_if(list.begin(), list.end(),
+                                          [this](int id) {
+                                              return isRetired(id);
+                                          }),
+                           list.end());
+            }
+            list.push_back(from);
+        }
+
+        // from now depends on to
+        markDirty(from);
+
+        if (profiler.isEnabled()) {
+            profiler.recordAllocation(sizeof(NodePtr<T>));
+        }
     }
 
     void addEdge(Variable<T> *v1, Variable<T> *v2) {
-        int from = v1->getNodeId();
-        int to = v2->getNodeId();
+        addEdge(v1->getNodeId(), v2->getNodeId());
+    }
 
-        edgeMap[from].push_back(nodes[to]);
+    // flags a node and everything computed from it for recomputation. a
+    // dirty node's consumers are always dirty too, so the walk stops there
+    void markDirty(int id) {
+        std::vector<int> s;
+
+        if (isRetired(id)) {
+            // the node itself is frozen, but live nodes may still read it
+            auto it = retiredConsumers.find(id);
+            if (it == retiredConsumers.end()) {
+                return;
+            }
+
+            s.assign(it->second.begin(), it->second.end());
+        } else if (nodes[id - baseId]->isDirty()) {
+            // the common case while recording: a brand new node
+            return;
+        } else {
+            s.push_back(id);
+        }
+
+        while (!s.empty()) {
+            int next = s.back();
+            s.pop_back();
+
+            if (isRetired(next)) {
+                continue;
+            }
+
+            NodePtr<T> &node = nodes[next - baseId];
+            if (node->isDirty()) {
+                continue;
+            }
+
+            node->setDirty(true);
+            gradCache.erase(next);
+
+            for (int consumer : consumers[next - baseId]) {
+                s.push_back(consumer);
+            }
+        }
+    }
+
+    // with incremental off every compute re-runs all nodes under its target,
+    // needed once buffers share storage (see applyPlan)
+    void setIncremental(bool incremental) {
+        this->incremental = incremental;
+    }
+    bool isIncremental() {
+        return incremental;
+    }
+
+    // forces the next compute to re-run every live node, for when buffers
+    // were written behind the tape's back
+    void invalidate() {
+        for (auto node : nodes) {
+            node->setDirty(true);
+        }
+
+        gradCache.clear();
     }
 
     int addVariable(Variable<T> *v) {
-        std::shared_ptr<Constant<T>> op(new Constant<T>(v->getBuffer()));
-        createNode(op);
+        createNode(make<Constant<T>>(v->getBuffer()));
+
+        if (profiler.isEnabled()) {
+            profiler.recordAllocation(sizeof(Buffer<T>));
+        }
 
         return idCount - 1;
     }
 
     void compute(Variable<T> *v) {
-        using P = std::pair<NodePtr<T>, int>;
+        using P = std::pair<NodePtr<T>, size_t>;
 
         // TODO: ensure graph is acyclic/accommodate cycles
         //
         // in-order depth-first traversal to calculate up from constants
         // (outer nodes)
 
+        if (!incremental) {
+            invalidate();
+        }
+
+        const bool profiling = profiler.isEnabled();
+        Profiler::Clock::time_point callStart;
+        int64_t visited = 0;
+        if (profiling) {
+            callStart = Profiler::Clock::now();
+        }
+
+        // clean nodes are up to date along with all of their inputs, and
+        // retired values are frozen, so neither is descended into
+        auto needsCompute = [this](const NodePtr<T> &node) {
+            return !isRetired(node->getId()) && node->isDirty();
+        };
+
         std::stack<P> s;
-        s.emplace(nodes[v->getNodeId()], 0);
+        NodePtr<T> root = getNode(v->getNodeId());
+        if (needsCompute(root)) {
+            s.emplace(root, 0);
+        }
 
         while (!s.empty()) {
             auto &[node, index] = s.top();
             int id = node->getId();
 
-            if (index == edgeMap[id].size()) {
-                node->compute();
+            const EdgeList<T> &edges = edgeMap[id - baseId];
+            if (index == edges.size()) {
+                if (profiling) {
+                    auto start = Profiler::Clock::now();
+                    node->compute();
+                    profiler.recordForward(node->getOpCode(), start,
+                                           Profiler::Clock::now());
+                    visited++;
+                } else {
+                    node->compute();
+                }
+
+                node->setDirty(false);
                 s.pop();
             } else {
-                s.emplace(edgeMap[id][index++], 0);
+                const NodePtr<T> &next = edges[index++];
+                if (needsCompute(next)) {
+                    s.emplace(next, 0);
+                }
             }
         }
+
+        if (profiling) {
+            profiler.recordEvent("compute", callStart, Profiler::Clock::now(),
+                                 visited);
+        }
     }
 
     // get path to target from wrt
     // clone graph
     // use path to replace dependent nodes with derivative
     T gradient(Variable<T> &target, Variable<T> &wrt) {
-        GradSubgraph<T> graph = buildGradSubgraph(target, wrt);
-        return graph.computeGradient();
+        int targetId = target.getNodeId();
+        int wrtId = wrt.getNodeId();
+
+        bool cacheable = !isRetired(targetId) && !getNode(targetId)->isDirty();
+        if (cacheable) {
+            auto it = gradCache.find(targetId);
+            if (it != gradCache.end()) {
+                auto hit = it->second.find(wrtId);
+                if (hit != it->second.end()) {
+                    return hit->second;
+                }
+            }
+        }
+
+        T result;
+        if (!profiler.isEnabled()) {
+            GradSubgraph<T> graph = buildGradSubgraph(target, wrt);
+            result = graph.computeGradient();
+        } else {
+            auto start = Profiler::Clock::now();
+            GradSubgraph<T> graph = buildGradSubgraph(target, wrt);
+            result = graph.computeGradient(&profiler);
+            profiler.recordEvent("gradient", start, Profiler::Clock::now(),
+                                 graph.getNodeCount());
+        }
+
+        if (cacheable) {
+            gradCache[targetId][wrtId] = result;
+        }
+
+        return result;
+    }
+
+    // the subgraph behind gradient(target, wrt). it reads operand values
+    // when evaluated and stays valid until edges change, so callers taking
+    // the same derivative at many points can build it once and call
+    // computeGradient after each compute
+    GradSubgraph<T> gradientGraph(Variable<T> &target, Variable<T> &wrt) {
+        return buildGradSubgraph(target, wrt);
+    }
+
+    // measures the live graph for the profiler: depth is the longest chain
+    // of edges, width the most nodes sharing one depth
+    void recordShape() {
+        std::unordered_map<int, int> level;
+        std::unordered_map<int, int> levelSizes;
+        std::stack<std::pair<int, size_t>> s;
+
+        for (auto root : nodes) {
+            if (level.find(root->getId()) != level.end()) {
+                continue;
+            }
+
+            s.emplace(root->getId(), 0);
+            while (!s.empty()) {
+                auto &[id, index] = s.top();
+                const EdgeList<T> &edges = getEdges(id);
+
+                if (index < edges.size()) {
+                    int next = edges[index++]->getId();
+                    if (level.find(next) == level.end()) {
+                        s.emplace(next, 0);
+                    }
+
+                    continue;
+                }
+
+                int nodeLevel = 0;
+                for (auto edge : edges) {
+                    nodeLevel = std::max(nodeLevel, level[edge->getId()] + 1);
+                }
+
+                level[id] = nodeLevel;
+                levelSizes[nodeLevel]++;
+                s.pop();
+            }
+        }
+
+        int depth = 0;
+        int width = 0;
+        for (auto [nodeLevel, size] : levelSizes) {
+            depth = std::max(depth, nodeLevel + 1);
+            width = std::max(width, size);
+        }
+
+        profiler.recordShape(depth, width);
     }
 
     void printNodes() {
         std::cout << "GRAPH HAS " << nodes.size() << " NODES" << std::endl;
         for (auto node : nodes) {
             int id = node->getId();
-            for (auto edge : edgeMap[id]) {
+            for (auto edge : getEdges(id)) {
                 std::cout << id << " -> " << edge->getId() << std::endl;
             }
         }
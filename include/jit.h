@@ -0,0 +1,424 @@
+#ifndef JIT
+#define JIT
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <memory>
+#include <sstream>
+#include <stack>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "gradient.h"
+
+// native code for the graph under one target
+//
+// compileTape emits straight-line C for a forward pass and a reverse-mode
+// backward pass over one array of values, builds it into a shared object
+// with the system compiler ($REPLICANT_CC, default cc) and dlopens it.
+// objects are cached on disk by a hash of the generated source, so the same
+// graph is only compiled once per cache directory. the default directory is
+// per user ($XDG_CACHE_HOME or ~/.cache, else /tmp/replicant-jit-<uid>).
+// any cache directory must be owned by the current user and not writable by
+// anyone else, and so must every object loaded from it
+//
+// the graph is frozen at compile time: nodes added to the tape afterwards
+// are not seen. graphs with loops aren't supported
+
+template <typename T>
+struct JitType;
+
+template <>
+struct JitType<double> {
+    static constexpr const char *name = "double";
+    static constexpr const char *pow = "pow";
+    static constexpr const char *log = "log";
+};
+
+template <>
+struct JitType<float> {
+    static constexpr const char *name = "float";
+    static constexpr const char *pow = "powf";
+    static constexpr const char *log = "logf";
+};
+
+template <typename T>
+class CompiledTape;
+
+inline std::string defaultJitCacheDir() {
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    if (xdg && *xdg == '/') {
+        return std::string(xdg) + "/replicant-jit";
+    }
+
+    const char *home = getenv("HOME");
+    if (home && *home == '/') {
+        return std::string(home) + "/.cache/replicant-jit";
+    }
+
+    return "/tmp/replicant-jit-" + std::to_string(geteuid());
+}
+
+// true if path is ours and nobody else can write to it
+inline bool jitPathTrusted(const struct stat &st) {
+    return st.st_uid == geteuid() && !(st.st_mode & (S_IWGRP | S_IWOTH));
+}
+
+// creates the directory 0700 if it's missing
+inline bool jitCacheDirTrusted(const std::string &dir) {
+    std::error_code error;
+    std::filesystem::path parent = std::filesystem::path(dir).parent_path();
+    if (!parent.empty()) {
+        std::filesystem::create_directories(parent, error);
+    }
+    mkdir(dir.c_str(), 0700);
+
+    struct stat st;
+    return stat(dir.c_str(), &st) == 0 && S_ISDIR(st.st_mode) &&
+           jitPathTrusted(st);
+}
+
+template <typename T>
+std::unique_ptr<CompiledTape<T>> compileTape(
+    Tape<T> &tape, Variable<T> &target,
+    const std::string &cacheDir = defaultJitCacheDir());
+
+template <typename T>
+class CompiledTape {
+    using ForwardFn = void (*)(T *);
+    using BackwardFn = void (*)(const T *, T *);
+
+    std::shared_ptr<void> library;
+    ForwardFn forwardFn;
+    BackwardFn backwardFn;
+
+    std::vector<BufferPtr<T>> buffers;  // one per slot
+    std::vector<int> inputs;            // slots nothing writes
+    std::vector<int> outputs;           // slots written by an operation
+    std::unordered_map<Buffer<T> *, int> slotOf;
+    int targetSlot;
+
+    std::vector<T> values;
+    std::vector<T> adjoints;
+    bool adjointsValid;
+
+    template <typename U>
+    friend std::unique_ptr<CompiledTape<U>> compileTape(
+        Tape<U> &tape, Variable<U> &target, const std::string &cacheDir);
+
+    CompiledTape() : forwardFn(nullptr), backwardFn(nullptr) {}
+
+  public:
+    // reads every input from its buffer, runs the forward pass and writes
+    // the results back, so Variables see the new values
+    void compute() {
+        for (int slot : inputs) {
+            values[slot] = buffers[slot]->getValue();
+        }
+
+        forwardFn(values.data());
+
+        for (int slot : outputs) {
+            buffers[slot]->setValue(values[slot]);
+        }
+
+        adjointsValid = false;
+    }
+
+    // d target / d wrt at the last compute. one backward pass serves every
+    // wrt until the next compute
+    T gradient(Variable<T> &wrt) {
+        auto it = slotOf.find(wrt.getBuffer().get());
+        if (it == slotOf.end()) {
+            return 0;
+        }
+
+        if (!adjointsValid) {
+            backwardFn(values.data(), adjoints.data());
+            adjointsValid = true;
+        }
+
+        return adjoints[it->second];
+    }
+
+    T getValue() {
+        return values[targetSlot];
+    }
+
+    int getSlotCount() {
+        return values.size();
+    }
+};
+
+// returns nullptr if the graph has unsupported operations or the compiler
+// fails
+template <typename T>
+std::unique_ptr<CompiledTape<T>> compileTape(Tape<T> &tape,
+                                             Variable<T> &target,
+                                             const std::string &cacheDir) {
+    using P = std::pair<NodePtr<T>, size_t>;
+
+    std::unique_ptr<CompiledTape<T>> compiled(new CompiledTape<T>());
+
+    // post-order from the target, same order as a full compute
+    std::vector<OpPtr<T>> order;
+    std::unordered_set<int> visited;
+    std::stack<P> s;
+    s.emplace(tape.getNode(target.getNodeId()), 0);
+    visited.insert(target.getNodeId());
+
+    while (!s.empty()) {
+        auto &[node, index] = s.top();
+        const EdgeList<T> &edges = tape.getEdges(node->getId());
+
+        if (index == edges.size()) {
+            order.push_back(node->getOp());
+            s.pop();
+        } else {
+            const NodePtr<T> &next = edges[index++];
+            if (visited.insert(next->getId()).second) {
+                s.emplace(next, 0);
+            }
+        }
+    }
+
+    auto slotFor = [&](const BufferPtr<T> &buffer) {
+        auto it = compiled->slotOf.find(buffer.get());
+        if (it != compiled->slotOf.end()) {
+            return it->second;
+        }
+
+        int slot = compiled->buffers.size();
+        compiled->slotOf[buffer.get()] = slot;
+        compiled->buffers.push_back(buffer);
+
+        return slot;
+    };
+
+    const char *type = JitType<T>::name;
+    const char *pow = JitType<T>::pow;
+    const char *log = JitType<T>::log;
+
+    std::ostringstream forward, backward;
+    std::unordered_set<int> written;
+
+    for (auto &op : order) {
+        if (op->isConstant()) {
+            slotFor(op->getOutput());
+            continue;
+        }
+
+        int a = slotFor(op->getLhOperand());
+        int b = slotFor(op->getRhOperand());
+        int o = slotFor(op->getOutput());
+        written.insert(o);
+
+        std::string va = "v[" + std::to_string(a) + "]";
+        std::string vb = "v[" + std::to_string(b) + "]";
+        std::string vo = "v[" + std::to_string(o) + "]";
+
+        const char *symbol = nullptr;
+        switch (op->getOpCode()) {
+            case OpCode::Multiply:
+                symbol = " * ";
+                break;
+            case OpCode::Divide:
+                symbol = " / ";
+                break;
+            case OpCode::Add:
+                symbol = " + ";
+                break;
+            case OpCode::Subtract:
+                symbol = " - ";
+                break;
+            case OpCode::Power:
+                break;
+            default:
+                return nullptr;
+        }
+
+        forward << "    " << vo << " = ";
+        if (symbol) {
+            forward << va << symbol << vb << ";\n";
+        } else {
+            forward << pow << "(" << va << ", " << vb << ");\n";
+        }
+    }
+
+    // adjoints flow in reverse order, each statement pushes g[o] into the
+    // operands. the log term of Power is skipped for non-positive bases,
+    // where the interpreter only evaluates it when the exponent varies
+    for (auto it = order.rbegin(); it != order.rend(); it++) {
+        OpPtr<T> &op = *it;
+        if (op->isConstant()) {
+            continue;
+        }
+
+        int a = compiled->slotOf[op->getLhOperand().get()];
+        int b = compiled->slotOf[op->getRhOperand().get()];
+        int o = compiled->slotOf[op->getOutput().get()];
+
+        std::string va = "v[" + std::to_string(a) + "]";
+        std::string vb = "v[" + std::to_string(b) + "]";
+        std::string vo = "v[" + std::to_string(o) + "]";
+        std::string ga = "g[" + std::to_string(a) + "]";
+        std::string gb = "g[" + std::to_string(b) + "]";
+        std::string go = "g[" + std::to_string(o) + "]";
+
+        switch (op->getOpCode()) {
+            case OpCode::Multiply:
+                backward << "    " << ga << " += " << go << " * " << vb
+                         << ";\n    " << gb << " += " << go << " * " << va
+                         << ";\n";
+                break;
+            case OpCode::Divide:
+                backward << "    " << ga << " += " << go << " / " << vb
+                         << ";\n    " << gb << " -= " << go << " * " << va
+                         << " / (" << vb << " * " << vb << ");\n";
+                break;
+            case OpCode::Add:
+                backward << "    " << ga << " += " << go << ";\n    " << gb
+                         << " += " << go << ";\n";
+                break;
+            case OpCode::Subtract:
+                backward << "    " << ga << " += " << go << ";\n    " << gb
+                         << " -= " << go << ";\n";
+                break;
+            case OpCode::Power:
+                backward << "    " << ga << " += " << go << " * " << vb
+                         << " * " << pow << "(" << va << ", " << vb
+                         << " - 1);\n    if (" << va << " > 0) " << gb
+                         << " += " << go << " * " << vo << " * " << log << "("
+                         << va << ");\n";
+                break;
+            default:
+                return nullptr;
+        }
+    }
+
+    compiled->targetSlot = slotFor(target.getBuffer());
+
+    int slotCount = compiled->buffers.size();
+    for (int slot = 0; slot < slotCount; slot++) {
+        if (written.count(slot)) {
+            compiled->outputs.push_back(slot);
+        } else {
+            compiled->inputs.push_back(slot);
+        }
+    }
+
+    std::ostringstream source;
+    source << "#include <math.h>\n\n"
+           << "void replicant_forward(" << type << " *v) {\n"
+           << forward.str() << "}\n\n"
+           << "void replicant_backward(const " << type << " *v, " << type
+           << " *g) {\n"
+           << "    for (int i = 0; i < " << slotCount << "; i++) g[i] = 0;\n"
+           << "    g[" << compiled->targetSlot << "] = 1;\n"
+           << backward.str() << "}\n";
+
+    std::string code = source.str();
+
+    const char *cc = getenv("REPLICANT_CC");
+    std::string compiler = cc ? cc : "cc";
+
+    // FNV-1a over the source and the compiler so either change rebuilds
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (char c : code + compiler) {
+        hash = (hash ^ (unsigned char)c) * 0x100000001b3ULL;
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "replicant_%016llx",
+             (unsigned long long)hash);
+
+    // the path goes into a single-quoted shell command
+    if (cacheDir.find('\'') != std::string::npos ||
+        !jitCacheDirTrusted(cacheDir)) {
+        return nullptr;
+    }
+
+    std::string base = cacheDir + "/" + name;
+    std::string object = base + ".so";
+
+    if (!std::filesystem::exists(object)) {
+        // unique names per builder, so concurrent builders of the same graph
+        // (threads or processes) never share a file. the finished object is
+        // renamed into place atomically
+        std::string sourcePath = base + ".XXXXXX.c";
+        std::string partial = base + ".XXXXXX.so";
+
+        int sourceFd = mkstemps(&sourcePath[0], 2);
+        if (sourceFd < 0) {
+            return nullptr;
+        }
+
+        bool sourceWritten = true;
+        for (size_t done = 0; sourceWritten && done < code.size();) {
+            ssize_t n = write(sourceFd, code.data() + done, code.size() - done);
+            sourceWritten = n > 0;
+            done += sourceWritten ? n : 0;
+        }
+        sourceWritten = close(sourceFd) == 0 && sourceWritten;
+
+        int partialFd = mkstemps(&partial[0], 3);
+        if (!sourceWritten || partialFd < 0) {
+            unlink(sourcePath.c_str());
+            return nullptr;
+        }
+        close(partialFd);
+
+        std::string command = compiler + " -O2 -shared -fPIC -o '" +
+                              partial + "' '" + sourcePath + "' -lm";
+        bool built = std::system(command.c_str()) == 0 &&
+                     chmod(partial.c_str(), 0700) == 0 &&
+                     rename(partial.c_str(), object.c_str()) == 0;
+
+        // the source is kept next to the object for inspection
+        if (built) {
+            rename(sourcePath.c_str(), (base + ".c").c_str());
+        } else {
+            unlink(sourcePath.c_str());
+            unlink(partial.c_str());
+            return nullptr;
+        }
+    }
+
+    struct stat st;
+    if (lstat(object.c_str(), &st) != 0 || !S_ISREG(st.st_mode) ||
+        !jitPathTrusted(st)) {
+        return nullptr;
+    }
+
+    void *handle = dlopen(object.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        return nullptr;
+    }
+
+    compiled->library = std::shared_ptr<void>(handle, dlclose);
+    compiled->forwardFn = (typename CompiledTape<T>::ForwardFn)dlsym(
+        handle, "replicant_forward");
+    compiled->backwardFn = (typename CompiledTape<T>::BackwardFn)dlsym(
+        handle, "replicant_backward");
+
+    if (!compiled->forwardFn || !compiled->backwardFn) {
+        return nullptr;
+    }
+
+    compiled->values.resize(slotCount);
+    compiled->adjoints.resize(slotCount);
+    compiled->adjointsValid = false;
+
+    return compiled;
+}
+
+#endif
@@ -0,0 +1,889 @@
+#ifndef LOCAL_TAPE
+#define LOCAL_TAPE
+
+#include <assert.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "conv.h"
+#include "sparse.h"
+
+// thread-confined tape with index-based handles
+//
+// a LocalTape keeps its nodes and values in flat arrays it owns outright. a
+// LocalVariable is a plain (tape, index) pair: copying one touches no
+// reference count and nothing is heap allocated per node beyond the arrays'
+// amortized growth.
+//
+// thread safety: a LocalTape and the LocalVariables recorded on it must only
+// be used by one thread at a time. separate tapes share no state at all, so
+// any number of threads can each drive their own tape without locks or
+// atomics. handing a tape to another thread is fine as long as the handoff
+// itself is synchronized (e.g. through a queue or thread join).
+//
+// operations are evaluated as they are recorded. after changing inputs with
+// setValue, compute() re-runs every node in recording order, which is
+// always a valid topological order
+//
+// besides scalars a node can hold a vector of values. the fused operations
+// (relu, tanh, sigmoid, log, softmax, logSoftmax, crossEntropy, layerNorm) are
+// one node each over a whole vector, with a hand-written backward that makes
+// a single pass over the operand instead of going through scalar nodes. the
+// row-wise ones treat the vector as rows of cols values
+//
+// conv2d, maxPool2d and avgPool2d work on the layouts described in conv.h.
+// a 1d convolution or pooling is the 2d one with a conv1dShape or
+// pool1dShape
+//
+// gather copies rows of an embedding table (a Matrix outside the tape) into
+// a node. the table gets no adjoints on the tape; sparseGradient collects
+// d target / d table for the gathered rows only, for sgdUpdate or
+// SparseAdagrad. the table must outlive the nodes gathering from it
+
+// what a LocalTape node does. kept apart from OpCode, which is part of the
+// tape file format
+enum class LocalOp : uint8_t {
+    Constant,
+    Multiply,
+    Divide,
+    Add,
+    Subtract,
+    Power,
+    Relu,
+    Tanh,
+    Sigmoid,
+    Log,
+    Softmax,
+    LogSoftmax,
+    CrossEntropy,
+    LayerNorm,
+    Conv2d,
+    MaxPool2d,
+    AvgPool2d,
+    Gather,
+};
+
+template <typename T>
+class LocalTape;
+
+template <typename T>
+class LocalVariable {
+    LocalTape<T> *tape;
+    int index;
+
+  public:
+    LocalVariable(LocalTape<T> *tape, int index) : tape(tape), index(index) {}
+
+    LocalTape<T> *getTape() const {
+        return tape;
+    }
+    int getIndex() const {
+        return index;
+    }
+
+    T getValue() const {
+        return tape->getValue(*this);
+    }
+};
+
+template <typename T>
+class LocalTape {
+    // every node owns values[offset, offset + size). cols is the row width
+    // of row-wise operations. aux is the first of a node's labels in indices
+    // for CrossEntropy, its entry in convs for convolutions and pooling and
+    // in gathers for Gather
+    struct LocalNode {
+        LocalOp op;
+        int lh;
+        int rh;
+        int offset;
+        int size;
+        int cols;
+        int aux;
+    };
+
+    std::vector<LocalNode> nodes;
+    std::vector<T> values;
+    std::vector<T> adjoints;
+    std::vector<int> indices;
+
+    struct ConvParams {
+        ConvShape shape;
+        int bias;  // node index, -1 without
+    };
+
+    std::vector<ConvParams> convs;
+
+    struct GatherParams {
+        const Matrix<T> *table;
+        int ids;  // first of the node's rows in indices
+        int count;
+    };
+
+    std::vector<GatherParams> gathers;
+    std::vector<T> scratch;
+
+    // node the adjoints were last propagated from, -1 once stale
+    int adjointsFrom;
+
+    int push(LocalOp op, int lh, int rh, int size, int cols = 1, int aux = -1) {
+        nodes.push_back({op, lh, rh, (int)values.size(), size, cols, aux});
+        values.resize(values.size() + size);
+        adjointsFrom = -1;
+
+        return nodes.size() - 1;
+    }
+
+    static bool isFused(LocalOp op) {
+        switch (op) {
+            case LocalOp::Relu:
+            case LocalOp::Tanh:
+            case LocalOp::Sigmoid:
+            case LocalOp::Log:
+            case LocalOp::Softmax:
+            case LocalOp::LogSoftmax:
+            case LocalOp::CrossEntropy:
+            case LocalOp::LayerNorm:
+            case LocalOp::Conv2d:
+            case LocalOp::MaxPool2d:
+            case LocalOp::AvgPool2d:
+            case LocalOp::Gather:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // max of a row and log sum exp(x - max)
+    static std::pair<T, T> logSumExp(const T *x, int cols) {
+        T m = x[0];
+        for (int j = 1; j < cols; j++) {
+            m = std::max(m, x[j]);
+        }
+
+        T sum = 0;
+        for (int j = 0; j < cols; j++) {
+            sum += exp(x[j] - m);
+        }
+
+        return {m, log(sum)};
+    }
+
+    // mean of a row and 1 / sqrt(variance + eps)
+    static std::pair<T, T> moments(const T *x, int cols, T eps) {
+        T mean = 0;
+        for (int j = 0; j < cols; j++) {
+            mean += x[j];
+        }
+        mean /= cols;
+
+        T variance = 0;
+        for (int j = 0; j < cols; j++) {
+            variance += (x[j] - mean) * (x[j] - mean);
+        }
+        variance /= cols;
+
+        return {mean, 1 / sqrt(variance + eps)};
+    }
+
+    void forwardGather(const LocalNode &node) {
+        const GatherParams &gather = gathers[node.aux];
+        const Matrix<T> &table = *gather.table;
+        T *y = &values[node.offset];
+
+        for (int k = 0; k < gather.count; k++, y += table.cols) {
+            const T *row = &table(indices[gather.ids + k], 0);
+            std::copy(row, row + table.cols, y);
+        }
+    }
+
+    void forwardFused(const LocalNode &node) {
+        if (node.op == LocalOp::Gather) {
+            forwardGather(node);
+            return;
+        }
+
+        const LocalNode &operand = nodes[node.lh];
+        const T *x = &values[operand.offset];
+        T *y = &values[node.offset];
+        int n = operand.size;
+        int cols = node.cols;
+        int rows = n / cols;
+
+        switch (node.op) {
+            case LocalOp::Relu:
+                for (int i = 0; i < n; i++) {
+                    y[i] = x[i] > 0 ? x[i] : 0;
+                }
+                break;
+            case LocalOp::Tanh:
+                for (int i = 0; i < n; i++) {
+                    y[i] = tanh(x[i]);
+                }
+                break;
+            case LocalOp::Sigmoid:
+                for (int i = 0; i < n; i++) {
+                    y[i] = 1 / (1 + exp(-x[i]));
+                }
+                break;
+            case LocalOp::Log:
+                for (int i = 0; i < n; i++) {
+                    y[i] = log(x[i]);
+                }
+                break;
+            case LocalOp::Softmax:
+                for (int r = 0; r < rows; r++, x += cols, y += cols) {
+                    auto [m, lse] = logSumExp(x, cols);
+                    for (int j = 0; j < cols; j++) {
+                        y[j] = exp(x[j] - m - lse);
+                    }
+                }
+                break;
+            case LocalOp::LogSoftmax:
+                for (int r = 0; r < rows; r++, x += cols, y += cols) {
+                    auto [m, lse] = logSumExp(x, cols);
+                    for (int j = 0; j < cols; j++) {
+                        y[j] = x[j] - m - lse;
+                    }
+                }
+                break;
+            case LocalOp::CrossEntropy: {
+                T loss = 0;
+                for (int r = 0; r < rows; r++, x += cols) {
+                    auto [m, lse] = logSumExp(x, cols);
+                    loss += m + lse - x[indices[node.aux + r]];
+                }
+                *y = loss / rows;
+                break;
+            }
+            case LocalOp::LayerNorm: {
+                T eps = values[nodes[node.rh].offset];
+                for (int r = 0; r < rows; r++, x += cols, y += cols) {
+                    auto [mean, rstd] = moments(x, cols, eps);
+                    for (int j = 0; j < cols; j++) {
+                        y[j] = (x[j] - mean) * rstd;
+                    }
+                }
+                break;
+            }
+            case LocalOp::Conv2d: {
+                const ConvParams &conv = convs[node.aux];
+                const T *w = &values[nodes[node.rh].offset];
+                const T *bias = conv.bias < 0
+                                    ? nullptr
+                                    : &values[nodes[conv.bias].offset];
+
+                conv2d(conv.shape, x, w, bias, y, scratch);
+                break;
+            }
+            case LocalOp::MaxPool2d:
+            case LocalOp::AvgPool2d:
+                pool2d(convs[node.aux].shape, node.op == LocalOp::MaxPool2d,
+                       x, y);
+                break;
+            default:
+                assert(false);
+        }
+    }
+
+    // adds d target / d x to the operand's adjoints given the output's
+    void backwardFused(const LocalNode &node) {
+        // the table's gradient is read off the node's adjoints afterwards
+        if (node.op == LocalOp::Gather) {
+            return;
+        }
+
+        const LocalNode &operand = nodes[node.lh];
+        const T *x = &values[operand.offset];
+        const T *y = &values[node.offset];
+        const T *g = &adjoints[node.offset];
+        T *gx = &adjoints[operand.offset];
+        int n = operand.size;
+        int cols = node.cols;
+        int rows = n / cols;
+
+        switch (node.op) {
+            case LocalOp::Relu:
+                for (int i = 0; i < n; i++) {
+                    gx[i] += x[i] > 0 ? g[i] : 0;
+                }
+                break;
+            case LocalOp::Tanh:
+                for (int i = 0; i < n; i++) {
+                    gx[i] += g[i] * (1 - y[i] * y[i]);
+                }
+                break;
+            case LocalOp::Sigmoid:
+                for (int i = 0; i < n; i++) {
+                    gx[i] += g[i] * y[i] * (1 - y[i]);
+                }
+                break;
+            case LocalOp::Log:
+                for (int i = 0; i < n; i++) {
+                    gx[i] += g[i] / x[i];
+                }
+                break;
+            case LocalOp::Softmax:
+                for (int r = 0; r < rows;
+                     r++, y += cols, g += cols, gx += cols) {
+                    T dot = 0;
+                    for (int j = 0; j < cols; j++) {
+                        dot += g[j] * y[j];
+                    }
+                    for (int j = 0; j < cols; j++) {
+                        gx[j] += y[j] * (g[j] - dot);
+                    }
+                }
+                break;
+            case LocalOp::LogSoftmax:
+                for (int r = 0; r < rows;
+                     r++, y += cols, g += cols, gx += cols) {
+                    T sum = 0;
+                    for (int j = 0; j < cols; j++) {
+                        sum += g[j];
+                    }
+                    for (int j = 0; j < cols; j++) {
+                        gx[j] += g[j] - exp(y[j]) * sum;
+                    }
+                }
+                break;
+            // softmax(x) - onehot(label) per row, recomputed from the logits
+            case LocalOp::CrossEntropy: {
+                T scale = *g / rows;
+                for (int r = 0; r < rows; r++, x += cols, gx += cols) {
+                    auto [m, lse] = logSumExp(x, cols);
+                    for (int j = 0; j < cols; j++) {
+                        gx[j] += scale * exp(x[j] - m - lse);
+                    }
+                    gx[indices[node.aux + r]] -= scale;
+                }
+                break;
+            }
+            // (g - mean(g) - y * mean(g * y)) / std, with std recomputed from
+            // the operand. eps is taken as a constant
+            case LocalOp::LayerNorm: {
+                T eps = values[nodes[node.rh].offset];
+                for (int r = 0; r < rows;
+                     r++, x += cols, y += cols, g += cols, gx += cols) {
+                    T rstd = moments(x, cols, eps).second;
+
+                    T meanG = 0;
+                    T meanGY = 0;
+                    for (int j = 0; j < cols; j++) {
+                        meanG += g[j];
+                        meanGY += g[j] * y[j];
+                    }
+                    meanG /= cols;
+                    meanGY /= cols;
+
+                    for (int j = 0; j < cols; j++) {
+                        gx[j] += rstd * (g[j] - meanG - y[j] * meanGY);
+                    }
+                }
+                break;
+            }
+            case LocalOp::Conv2d: {
+                const ConvParams &conv = convs[node.aux];
+                const T *w = &values[nodes[node.rh].offset];
+                T *gw = &adjoints[nodes[node.rh].offset];
+                T *gb = conv.bias < 0 ? nullptr
+                                      : &adjoints[nodes[conv.bias].offset];
+
+                conv2dBackward(conv.shape, x, w, g, gx, gw, gb, scratch);
+                break;
+            }
+            case LocalOp::MaxPool2d:
+            case LocalOp::AvgPool2d:
+                pool2dBackward(convs[node.aux].shape,
+                               node.op == LocalOp::MaxPool2d, x, g, gx);
+                break;
+            default:
+                assert(false);
+        }
+    }
+
+    void forwardNode(const LocalNode &node) {
+        T *out = &values[node.offset];
+        if (node.op == LocalOp::Constant) {
+            return;
+        }
+        if (isFused(node.op)) {
+            forwardFused(node);
+            return;
+        }
+
+        T a = values[nodes[node.lh].offset];
+        T b = values[nodes[node.rh].offset];
+
+        switch (node.op) {
+            case LocalOp::Multiply:
+                *out = a * b;
+                break;
+            case LocalOp::Divide:
+                *out = a / b;
+                break;
+            case LocalOp::Add:
+                *out = a + b;
+                break;
+            case LocalOp::Subtract:
+                *out = a - b;
+                break;
+            case LocalOp::Power:
+                *out = pow(a, b);
+                break;
+            default:
+                assert(false);
+        }
+    }
+
+    // pushes the node's adjoint into its operands. the log term of Power is
+    // skipped for non-positive bases, as in the compiled backend
+    void backwardNode(const LocalNode &node) {
+        if (node.op == LocalOp::Constant) {
+            return;
+        }
+        if (isFused(node.op)) {
+            backwardFused(node);
+            return;
+        }
+
+        T g = adjoints[node.offset];
+        T a = values[nodes[node.lh].offset];
+        T b = values[nodes[node.rh].offset];
+        T &ga = adjoints[nodes[node.lh].offset];
+        T &gb = adjoints[nodes[node.rh].offset];
+
+        switch (node.op) {
+            case LocalOp::Multiply:
+                ga += g * b;
+                gb += g * a;
+                break;
+            case LocalOp::Divide:
+                ga += g / b;
+                gb -= g * a / (b * b);
+                break;
+            case LocalOp::Add:
+                ga += g;
+                gb += g;
+                break;
+            case LocalOp::Subtract:
+                ga += g;
+                gb -= g;
+                break;
+            case LocalOp::Power:
+                ga += g * b * pow(a, b - 1);
+                if (a > 0) {
+                    gb += g * values[node.offset] * log(a);
+                }
+                break;
+            default:
+                assert(false);
+        }
+    }
+
+  public:
+    LocalTape() : adjointsFrom(-1) {}
+
+    // pre-sizes the arrays so recording doesn't reallocate
+    void reserve(int nodeCount, int valueCount) {
+        nodes.reserve(nodeCount);
+        values.reserve(valueCount);
+    }
+
+    // drops every node but keeps the storage, for reusing one tape across
+    // many small computations
+    void clear() {
+        nodes.clear();
+        values.clear();
+        indices.clear();
+        convs.clear();
+        gathers.clear();
+        adjointsFrom = -1;
+    }
+
+    int getNodeCount() {
+        return nodes.size();
+    }
+
+    LocalVariable<T> variable(T value) {
+        int index = push(LocalOp::Constant, -1, -1, 1);
+        values[nodes[index].offset] = value;
+
+        return LocalVariable<T>(this, index);
+    }
+
+    LocalVariable<T> variable(const std::vector<T> &data) {
+        int index = push(LocalOp::Constant, -1, -1, data.size());
+        std::copy(data.begin(), data.end(), &values[nodes[index].offset]);
+
+        return LocalVariable<T>(this, index);
+    }
+
+    // scalar operations, both operands must hold one value
+    LocalVariable<T> record(LocalOp op, const LocalVariable<T> &lh,
+                            const LocalVariable<T> &rh) {
+        assert(lh.getTape() == this && rh.getTape() == this);
+        assert(getSize(lh) == 1 && getSize(rh) == 1);
+
+        int index = push(op, lh.getIndex(), rh.getIndex(), 1);
+        forwardNode(nodes[index]);
+
+        return LocalVariable<T>(this, index);
+    }
+
+    // a fused operation over x, row by row for cols values at a time. cols
+    // of 0 means the whole vector is one row
+    LocalVariable<T> fused(LocalOp op, const LocalVariable<T> &x,
+                           int cols = 0) {
+        assert(x.getTape() == this && isFused(op));
+        assert(op != LocalOp::CrossEntropy && op != LocalOp::LayerNorm);
+
+        int size = getSize(x);
+        cols = cols ? cols : size;
+        assert(size % cols == 0);
+
+        int index = push(op, x.getIndex(), -1, size, cols);
+        forwardNode(nodes[index]);
+
+        return LocalVariable<T>(this, index);
+    }
+
+    // mean over rows of -log softmax(row)[label], one label per row
+    LocalVariable<T> crossEntropy(const LocalVariable<T> &logits,
+                                  const std::vector<int> &rowLabels) {
+        assert(logits.getTape() == this && !rowLabels.empty());
+        assert(getSize(logits) % rowLabels.size() == 0);
+
+        int cols = getSize(logits) / rowLabels.size();
+        for (int label : rowLabels) {
+            assert(label >= 0 && label < cols);
+        }
+        int aux = indices.size();
+        indices.insert(indices.end(), rowLabels.begin(), rowLabels.end());
+
+        int index = push(LocalOp::CrossEntropy, logits.getIndex(), -1, 1,
+                         cols, aux);
+        forwardNode(nodes[index]);
+
+        return LocalVariable<T>(this, index);
+    }
+
+    // each row shifted to zero mean and scaled to unit variance
+    LocalVariable<T> layerNorm(const LocalVariable<T> &x, int cols = 0,
+                               T eps = 1e-5) {
+        assert(x.getTape() == this);
+
+        int size = getSize(x);
+        cols = cols ? cols : size;
+        assert(size % cols == 0);
+
+        int epsIndex = variable(eps).getIndex();
+        int index =
+            push(LocalOp::LayerNorm, x.getIndex(), epsIndex, size, cols);
+        forwardNode(nodes[index]);
+
+        return LocalVariable<T>(this, index);
+    }
+
+    // bias, filters values, is skipped when null
+    LocalVariable<T> convolution(const LocalVariable<T> &x,
+                                 const LocalVariable<T> &w,
+                                 const LocalVariable<T> *bias,
+                                 const ConvShape &shape) {
+        assert(x.getTape() == this && w.getTape() == this);
+        assert(getSize(x) == shape.inputSize());
+        assert(getSize(w) == shape.weightSize());
+        assert(!bias || getSize(*bias) == shape.filters);
+
+        int aux = convs.size();
+        convs.push_back({shape, bias ? bias->getIndex() : -1});
+
+        int index = push(LocalOp::Conv2d, x.getIndex(), w.getIndex(),
+                         shape.outputSize(), 1, aux);
+        forwardNode(nodes[index]);
+
+        return LocalVariable<T>(this, index);
+    }
+
+    LocalVariable<T> pooling(LocalOp op, const LocalVariable<T> &x,
+                             const ConvShape &shape) {
+        assert(x.getTape() == this && getSize(x) == shape.inputSize());
+        assert(op == LocalOp::MaxPool2d || op == LocalOp::AvgPool2d);
+        assert(shape.padH == 0 && shape.padW == 0);
+
+        int aux = convs.size();
+        convs.push_back({shape, -1});
+
+        int index = push(op, x.getIndex(), -1, shape.outputSize(), 1, aux);
+        forwardNode(nodes[index]);
+
+        return LocalVariable<T>(this, index);
+    }
+
+    // table rows ids, one after the other, as a single node
+    LocalVariable<T> gather(const Matrix<T> &table,
+                            const std::vector<int> &ids) {
+        for (int id : ids) {
+            assert(id >= 0 && id < table.rows);
+        }
+
+        int aux = gathers.size();
+        gathers.push_back({&table, (int)indices.size(), (int)ids.size()});
+        indices.insert(indices.end(), ids.begin(), ids.end());
+
+        int index = push(LocalOp::Gather, -1, -1, ids.size() * table.cols,
+                         table.cols, aux);
+        forwardNode(nodes[index]);
+
+        return LocalVariable<T>(this, index);
+    }
+
+    // d target / d table from the last backward, for the rows gathered
+    // since the last clear. ids gathered more than once are summed
+    SparseGradient<T> sparseGradient(const Matrix<T> &table) {
+        assert(adjointsFrom != -1);
+
+        SparseGradient<T> grad(table.cols);
+        for (const LocalNode &node : nodes) {
+            if (node.op != LocalOp::Gather ||
+                gathers[node.aux].table != &table) {
+                continue;
+            }
+
+            const GatherParams &gather = gathers[node.aux];
+            const T *g = &adjoints[node.offset];
+            for (int k = 0; k < gather.count; k++, g += table.cols) {
+                grad.add(indices[gather.ids + k], g);
+            }
+        }
+
+        return grad;
+    }
+
+    int getSize(const LocalVariable<T> &v) {
+        return nodes[v.getIndex()].size;
+    }
+
+    const T *getValues(const LocalVariable<T> &v) {
+        return &values[nodes[v.getIndex()].offset];
+    }
+
+    void setValues(const LocalVariable<T> &v, const std::vector<T> &data) {
+        assert((int)data.size() == getSize(v));
+
+        T *out = &values[nodes[v.getIndex()].offset];
+        std::copy(data.begin(), data.end(), out);
+        adjointsFrom = -1;
+    }
+
+    // adjoints of every value v holds, valid after backward
+    const T *getAdjoints(const LocalVariable<T> &v) {
+        return &adjoints[nodes[v.getIndex()].offset];
+    }
+
+    T getValue(const LocalVariable<T> &v) {
+        return values[nodes[v.getIndex()].offset];
+    }
+
+    void setValue(const LocalVariable<T> &v, T value) {
+        values[nodes[v.getIndex()].offset] = value;
+        adjointsFrom = -1;
+    }
+
+    void compute() {
+        for (const LocalNode &node : nodes) {
+            forwardNode(node);
+        }
+
+        adjointsFrom = -1;
+    }
+
+    // reverse sweep from target, after which getAdjoint(v) is
+    // d target / d v for every node
+    void backward(const LocalVariable<T> &target) {
+        backward(target, [](int) {});
+    }
+
+    // same, calling ready(index) as soon as a node's adjoint is final and
+    // the node is done with it, so e.g. parameter gradients can be sent off
+    // while the sweep goes on. nodes come in decreasing index order, so a
+    // parameter recorded right before its use is ready early
+    template <typename F>
+    void backward(const LocalVariable<T> &target, F ready) {
+        adjoints.assign(values.size(), 0);
+        adjoints[nodes[target.getIndex()].offset] = 1;
+
+        for (int i = target.getIndex(); i >= 0; i--) {
+            backwardNode(nodes[i]);
+            ready(i);
+        }
+
+        adjointsFrom = target.getIndex();
+    }
+
+    T getAdjoint(const LocalVariable<T> &v) {
+        return adjoints[nodes[v.getIndex()].offset];
+    }
+
+    // one sweep serves every wrt until the tape changes
+    T gradient(const LocalVariable<T> &target, const LocalVariable<T> &wrt) {
+        if (adjointsFrom != target.getIndex()) {
+            backward(target);
+        }
+
+        return getAdjoint(wrt);
+    }
+};
+
+template <typename T>
+LocalVariable<T> operator*(const LocalVariable<T> &v1,
+                           const LocalVariable<T> &v2) {
+    return v1.getTape()->record(LocalOp::Multiply, v1, v2);
+}
+
+template <typename T>
+LocalVariable<T> operator*(const LocalVariable<T> &v1, T v2) {
+    return v1 * v1.getTape()->variable(v2);
+}
+
+template <typename T>
+LocalVariable<T> operator*(T v1, const LocalVariable<T> &v2) {
+    return v2.getTape()->variable(v1) * v2;
+}
+
+template <typename T>
+LocalVariable<T> operator/(const LocalVariable<T> &v1,
+                           const LocalVariable<T> &v2) {
+    return v1.getTape()->record(LocalOp::Divide, v1, v2);
+}
+
+template <typename T>
+LocalVariable<T> operator/(const LocalVariable<T> &v1, T v2) {
+    return v1 / v1.getTape()->variable(v2);
+}
+
+template <typename T>
+LocalVariable<T> operator/(T v1, const LocalVariable<T> &v2) {
+    return v2.getTape()->variable(v1) / v2;
+}
+
+template <typename T>
+LocalVariable<T> operator+(const LocalVariable<T> &v1,
+                           const LocalVariable<T> &v2) {
+    return v1.getTape()->record(LocalOp::Add, v1, v2);
+}
+
+template <typename T>
+LocalVariable<T> operator+(const LocalVariable<T> &v1, T v2) {
+    return v1 + v1.getTape()->variable(v2);
+}
+
+template <typename T>
+LocalVariable<T> operator+(T v1, const LocalVariable<T> &v2) {
+    return v2.getTape()->variable(v1) + v2;
+}
+
+template <typename T>
+LocalVariable<T> operator-(const LocalVariable<T> &v1,
+                           const LocalVariable<T> &v2) {
+    return v1.getTape()->record(LocalOp::Subtract, v1, v2);
+}
+
+template <typename T>
+LocalVariable<T> operator-(const LocalVariable<T> &v1, T v2) {
+    return v1 - v1.getTape()->variable(v2);
+}
+
+template <typename T>
+LocalVariable<T> operator-(T v1, const LocalVariable<T> &v2) {
+    return v2.getTape()->variable(v1) - v2;
+}
+
+template <typename T>
+LocalVariable<T> operator^(const LocalVariable<T> &v1,
+                           const LocalVariable<T> &v2) {
+    return v1.getTape()->record(LocalOp::Power, v1, v2);
+}
+
+template <typename T>
+LocalVariable<T> operator^(const LocalVariable<T> &v1, T v2) {
+    return v1 ^ v1.getTape()->variable(v2);
+}
+
+template <typename T>
+LocalVariable<T> operator^(T v1, const LocalVariable<T> &v2) {
+    return v2.getTape()->variable(v1) ^ v2;
+}
+
+template <typename T>
+LocalVariable<T> relu(const LocalVariable<T> &x) {
+    return x.getTape()->fused(LocalOp::Relu, x);
+}
+
+template <typename T>
+LocalVariable<T> tanh(const LocalVariable<T> &x) {
+    return x.getTape()->fused(LocalOp::Tanh, x);
+}
+
+template <typename T>
+LocalVariable<T> sigmoid(const LocalVariable<T> &x) {
+    return x.getTape()->fused(LocalOp::Sigmoid, x);
+}
+
+template <typename T>
+LocalVariable<T> log(const LocalVariable<T> &x) {
+    return x.getTape()->fused(LocalOp::Log, x);
+}
+
+template <typename T>
+LocalVariable<T> softmax(const LocalVariable<T> &x, int cols = 0) {
+    return x.getTape()->fused(LocalOp::Softmax, x, cols);
+}
+
+template <typename T>
+LocalVariable<T> logSoftmax(const LocalVariable<T> &x, int cols = 0) {
+    return x.getTape()->fused(LocalOp::LogSoftmax, x, cols);
+}
+
+template <typename T>
+LocalVariable<T> crossEntropy(const LocalVariable<T> &logits,
+                              const std::vector<int> &labels) {
+    return logits.getTape()->crossEntropy(logits, labels);
+}
+
+template <typename T>
+LocalVariable<T> layerNorm(const LocalVariable<T> &x, int cols = 0,
+                           T eps = 1e-5) {
+    return x.getTape()->layerNorm(x, cols, eps);
+}
+
+template <typename T>
+LocalVariable<T> conv2d(const LocalVariable<T> &x, const LocalVariable<T> &w,
+                        const LocalVariable<T> &bias,
+                        const ConvShape &shape) {
+    return x.getTape()->convolution(x, w, &bias, shape);
+}
+
+template <typename T>
+LocalVariable<T> conv2d(const LocalVariable<T> &x, const LocalVariable<T> &w,
+                        const ConvShape &shape) {
+    return x.getTape()->convolution(x, w, nullptr, shape);
+}
+
+template <typename T>
+LocalVariable<T> maxPool2d(const LocalVariable<T> &x,
+                           const ConvShape &shape) {
+    return x.getTape()->pooling(LocalOp::MaxPool2d, x, shape);
+}
+
+template <typename T>
+LocalVariable<T> avgPool2d(const LocalVariable<T> &x,
+                           const ConvShape &shape) {
+    return x.getTape()->pooling(LocalOp::AvgPool2d, x, shape);
+}
+
+#endif
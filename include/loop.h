@@ -0,0 +1,140 @@
+#ifndef LOOP
+#define LOOP
+
+#include <cassert>
+#include <utility>
+#include <vector>
+
+#include "gradient.h"
+
+// runs a recorded body a fixed number of times as a single node
+//
+//   state_0     = init
+//   state_{i+1} = body(state_i, param)
+//   output      = state_iterations
+//
+// the body is recorded once on a tape of its own, so the outer tape grows by
+// a constant number of nodes however many iterations run. it may only use
+// its two arguments and constants it creates itself
+template <typename T>
+class Loop : public Operation<T> {
+    TapePtr<T> body;
+    Variable<T> stateIn;
+    Variable<T> paramIn;
+    Variable<T> stateOut;
+
+    GradSubgraph<T> stateGraph;
+    GradSubgraph<T> paramGraph;
+
+    int iterations;
+
+    // state entering every iteration of the last compute, the only thing
+    // kept for differentiate
+    std::vector<T> states;
+
+    // d state_{i+1} / d state_i and d state_{i+1} / d param, replayed from
+    // states the first time they are needed after a compute
+    std::vector<std::pair<T, T>> partials;
+    bool partialsValid;
+
+  public:
+    template <typename F>
+    Loop(BufferPtr<T> init, BufferPtr<T> param, BufferPtr<T> out,
+         int iterations, F bodyFn)
+        : Operation<T>(std::move(init), std::move(param), std::move(out)),
+          body(new Tape<T>()),
+          stateIn(0, body),
+          paramIn(0, body),
+          stateOut(bodyFn(stateIn, paramIn)),
+          stateGraph(body->gradientGraph(stateOut, stateIn)),
+          paramGraph(body->gradientGraph(stateOut, paramIn)),
+          iterations(iterations),
+          partialsValid(false) {
+        assert(iterations >= 0);
+    }
+
+    void compute() {
+        T state = this->lhOperand->getValue();
+        paramIn.setValue(this->rhOperand->getValue());
+
+        states.resize(iterations);
+        for (int i = 0; i < iterations; i++) {
+            states[i] = state;
+            stateIn.setValue(state);
+            body->compute(&stateOut);
+            state = stateOut.getValue();
+        }
+
+        partialsValid = false;
+        this->output->setValue(state);
+    }
+
+    OpCode getOpCode() {
+        return OpCode::Loop;
+    }
+
+    // works from the stored states rather than u and v
+    bool differentiateUsesOperands() {
+        return false;
+    }
+
+    T differentiate(T, T du, T, T dv) {
+        if (!partialsValid) {
+            partials.resize(states.size());
+            for (size_t i = 0; i < states.size(); i++) {
+                stateIn.setValue(states[i]);
+                body->compute(&stateOut);
+                partials[i] = {stateGraph.computeGradient(),
+                               paramGraph.computeGradient()};
+            }
+
+            partialsValid = true;
+        }
+
+        T d = du;
+        for (auto &[dState, dParam] : partials) {
+            d = dState * d + dParam * dv;
+        }
+
+        return d;
+    }
+
+    int getIterations() {
+        return iterations;
+    }
+    int getBodyNodeCount() {
+        return body->getNodeCount();
+    }
+};
+
+// body is called once with (Variable<T> &state, Variable<T> &param) and
+// returns the next state
+template <typename T, typename F>
+Variable<T> loop(const Variable<T> &init, const Variable<T> &param,
+                 int iterations, F body) {
+    assert(iterations >= 0);
+
+    const TapePtr<T> &tape = init.getTape();
+    Variable<T> output(tape);
+    OpPtr<T> op = tape->template make<Loop<T>>(
+        init.getBuffer(), param.getBuffer(), output.getBuffer(), iterations,
+        body);
+
+    opOverload(init.getNodeId(), param.getNodeId(), tape, std::move(op),
+               output.getNodeId());
+
+    return output;
+}
+
+// body(state) only
+template <typename T, typename F>
+Variable<T> loop(const Variable<T> &init, int iterations, F body) {
+    Variable<T> unused(0, init.getTape());
+
+    return loop(init, unused, iterations,
+                [&body](Variable<T> &state, Variable<T> &) {
+                    return body(state);
+                });
+}
+
+#endif
@@ -4,20 +4,48 @@
 
 #include "matrix.h"
 
-// naive implementation
+// c (m x n) += op(a) (m x k) * op(b) (k x n) over row-major arrays. transA
+// means a is stored k x m, transB that b is stored n x k
+//
+// the untransposed b case runs i-k-j so the inner loop streams rows of b
+// and c and vectorizes
 template <typename T>
-Matrix<T> matmul(Matrix<T> m1, Matrix<T> m2) {
-    assert(m1.cols == m2.rows);
+void gemm(const T *a, const T *b, T *c, int m, int n, int k,
+          bool transA = false, bool transB = false) {
+    for (int i = 0; i < m; i++) {
+        T *ci = c + (long)i * n;
 
-    Matrix<T> m3(m1.rows, m2.cols);
+        if (transB) {
+            for (int j = 0; j < n; j++) {
+                const T *bj = b + (long)j * k;
+
+                T sum = 0;
+                for (int p = 0; p < k; p++) {
+                    sum += (transA ? a[(long)p * m + i] : a[(long)i * k + p]) *
+                           bj[p];
+                }
+                ci[j] += sum;
+            }
+            continue;
+        }
+
+        for (int p = 0; p < k; p++) {
+            T aip = transA ? a[(long)p * m + i] : a[(long)i * k + p];
+            const T *bp = b + (long)p * n;
 
-    for (int i = 0; i < m3.rows; i++) {
-        for (int j = 0; j < m3.cols; j++) {
-            for (int k = 0; k < m2.cols; k++) {
-                m3(i, j) += m1(i, k) * m2(k, j);
+            for (int j = 0; j < n; j++) {
+                ci[j] += aip * bp[j];
             }
         }
     }
+}
+
+template <typename T>
+Matrix<T> matmul(const Matrix<T> &m1, const Matrix<T> &m2) {
+    assert(m1.cols == m2.rows);
+
+    Matrix<T> m3(m1.rows, m2.cols);
+    gemm(m1.getData(), m2.getData(), m3.getData(), m1.rows, m2.cols, m1.cols);
 
     return m3;
 }
@@ -0,0 +1,32 @@
+#ifndef MATRIX
+#define MATRIX
+
+#include <vector>
+
+// dense row-major matrix, zero initialized
+template <typename T>
+class Matrix {
+    std::vector<T> data;
+
+  public:
+    int rows;
+    int cols;
+
+    Matrix(int rows, int cols) : data(rows * cols, 0), rows(rows), cols(cols) {}
+
+    T &operator()(int i, int j) {
+        return data[i * cols + j];
+    }
+    const T &operator()(int i, int j) const {
+        return data[i * cols + j];
+    }
+
+    T *getData() {
+        return data.data();
+    }
+    const T *getData() const {
+        return data.data();
+    }
+};
+
+#endif
@@ -0,0 +1,201 @@
+#ifndef MEMORY_PLAN
+#define MEMORY_PLAN
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <stack>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "gradient.h"
+
+// slot assignment for the intermediate values computed under one target
+//
+// only buffers written by an operation are planned. inputs, the target and
+// any buffer still referenced from outside the planned nodes (a Variable the
+// caller holds, an operation off the target's path) keep their own storage
+template <typename T>
+struct MemoryPlan {
+    std::vector<BufferPtr<T>> buffers;
+    std::vector<int> slots;  // slots[i] is the slot of buffers[i]
+    int slotCount = 0;
+
+    // operations whose output took over the slot of one of their operands
+    int inPlace = 0;
+
+    size_t bytesBefore = 0;
+    size_t bytesAfter = 0;
+};
+
+// live ranges follow the order compute() runs nodes in. with keepForBackward
+// every operand that differentiate() reads stays live until the end so
+// Tape::gradient still sees correct values; without it the plan is only good
+// for forward passes
+template <typename T>
+MemoryPlan<T> planMemory(Tape<T> &tape, Variable<T> &target,
+                         bool keepForBackward = true) {
+    using P = std::pair<NodePtr<T>, size_t>;
+
+    // post-order from the target, same order as a full compute
+    std::vector<NodePtr<T>> order;
+    std::unordered_set<int> visited;
+    std::stack<P> s;
+    s.emplace(tape.getNode(target.getNodeId()), 0);
+    visited.insert(target.getNodeId());
+
+    while (!s.empty()) {
+        auto &[node, index] = s.top();
+        const EdgeList<T> &edges = tape.getEdges(node->getId());
+
+        if (index == edges.size()) {
+            order.push_back(node);
+            s.pop();
+        } else {
+            const NodePtr<T> &next = edges[index++];
+            if (visited.insert(next->getId()).second) {
+                s.emplace(next, 0);
+            }
+        }
+    }
+
+    struct Range {
+        int def = -1;
+        int last = -1;
+        int references = 0;
+        bool pinned = false;
+    };
+
+    const int end = order.size();
+    std::unordered_map<Buffer<T> *, Range> ranges;
+
+    auto read = [&](const BufferPtr<T> &buffer, int position, bool backward) {
+        if (!buffer) {
+            return;
+        }
+
+        Range &range = ranges[buffer.get()];
+        range.references++;
+        range.last = std::max(range.last, backward ? end : position);
+    };
+
+    for (int position = 0; position < end; position++) {
+        OpPtr<T> op = order[position]->getOp();
+        bool backward = keepForBackward && op->differentiateUsesOperands();
+
+        read(op->getLhOperand(), position, backward);
+        read(op->getRhOperand(), position, backward);
+
+        Range &output = ranges[op->getOutput().get()];
+        output.references++;
+        if (!op->isConstant() && output.def == -1) {
+            output.def = position;
+        }
+    }
+
+    // the references counted above are the only owners a buffer has among
+    // the planned nodes. any further owner, like a Variable the caller still
+    // holds or an operation off the target's path, can observe the value, so
+    // the buffer keeps its own storage. so do buffers no operation writes
+    for (int position = 0; position < end; position++) {
+        OpPtr<T> op = order[position]->getOp();
+        for (const BufferPtr<T> *buffer :
+             {&op->getLhOperand(), &op->getRhOperand(), &op->getOutput()}) {
+            if (!*buffer) {
+                continue;
+            }
+
+            Range &range = ranges[buffer->get()];
+            range.pinned = range.pinned || range.def == -1 ||
+                           buffer->use_count() > range.references;
+        }
+    }
+
+    // assign slots in order. operands dying at an operation are released
+    // before its output is placed, so the output can reuse one in place
+    MemoryPlan<T> plan;
+    std::unordered_map<Buffer<T> *, int> slotOf;
+    std::vector<int> freeSlots;
+
+    auto release = [&](const BufferPtr<T> &buffer, int position) {
+        if (!buffer) {
+            return;
+        }
+
+        auto it = slotOf.find(buffer.get());
+        if (it != slotOf.end() && ranges[buffer.get()].last == position) {
+            freeSlots.push_back(it->second);
+        }
+    };
+
+    for (int position = 0; position < end; position++) {
+        OpPtr<T> op = order[position]->getOp();
+        if (op->isConstant()) {
+            release(op->getLhOperand(), position);
+            continue;
+        }
+
+        const BufferPtr<T> &lh = op->getLhOperand();
+        const BufferPtr<T> &rh = op->getRhOperand();
+        release(lh, position);
+        if (rh != lh) {
+            release(rh, position);
+        }
+
+        const BufferPtr<T> &output = op->getOutput();
+        Range &range = ranges[output.get()];
+        if (range.pinned || range.def != position ||
+            slotOf.find(output.get()) != slotOf.end()) {
+            continue;
+        }
+
+        int slot;
+        if (freeSlots.empty()) {
+            slot = plan.slotCount++;
+        } else {
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+
+            bool reused = (lh && slotOf.count(lh.get()) &&
+                           slotOf[lh.get()] == slot) ||
+                          (rh && slotOf.count(rh.get()) &&
+                           slotOf[rh.get()] == slot);
+            if (reused) {
+                plan.inPlace++;
+            }
+        }
+
+        slotOf[output.get()] = slot;
+        plan.buffers.push_back(output);
+        plan.slots.push_back(slot);
+
+        // never read again
+        if (range.last < position) {
+            freeSlots.push_back(slot);
+        }
+    }
+
+    plan.bytesBefore = plan.buffers.size() * sizeof(T);
+    plan.bytesAfter = plan.slotCount * sizeof(T);
+
+    return plan;
+}
+
+// moves every planned buffer into one preallocated block. buffers sharing a
+// slot overwrite each other, so the tape stops computing incrementally
+template <typename T>
+void applyPlan(Tape<T> &tape, MemoryPlan<T> &plan) {
+    std::shared_ptr<T> block(new T[plan.slotCount](),
+                             std::default_delete<T[]>());
+
+    for (size_t i = 0; i < plan.buffers.size(); i++) {
+        T *slot = block.get() + plan.slots[i];
+        plan.buffers[i]->rebind(std::shared_ptr<T>(block, slot));
+    }
+
+    tape.setIncremental(false);
+    tape.invalidate();
+}
+
+#endif
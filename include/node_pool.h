@@ -0,0 +1,134 @@
+#ifndef NODE_POOL
+#define NODE_POOL
+
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <vector>
+
+// storage for everything a Tape records: nodes, operations, buffers and
+// edge lists. small blocks are carved out of large chunks and recycled
+// through one free list per size, so recording an operation only reaches
+// the heap when a chunk runs out
+//
+// a block may be returned after its tape is gone (a buffer still held by a
+// Variable or another tape), so the pool counts its live blocks and deletes
+// itself once the owner has let go and the last one is back. not thread
+// safe: a tape and what it records belong to one thread at a time
+class NodePool {
+    static const size_t granularity = alignof(std::max_align_t);
+    static const size_t maxBlock = 512;
+    static const size_t chunkSize = 64 * 1024;
+
+    struct FreeBlock {
+        FreeBlock *next;
+    };
+
+    FreeBlock *freeLists[maxBlock / granularity] = {};
+    std::vector<std::unique_ptr<char[]>> chunks;
+    char *cursor = nullptr;
+    char *end = nullptr;
+
+    size_t live = 0;
+    bool released = false;
+
+    NodePool() = default;
+
+    static size_t sizeClass(size_t bytes) {
+        return (bytes + granularity - 1) / granularity - 1;
+    }
+
+  public:
+    static NodePool *create() {
+        return new NodePool();
+    }
+
+    NodePool(const NodePool &) = delete;
+    NodePool &operator=(const NodePool &) = delete;
+
+    // called by the owner in place of delete
+    void release() {
+        released = true;
+        if (live == 0) {
+            delete this;
+        }
+    }
+
+    void *allocate(size_t bytes) {
+        live++;
+        if (bytes > maxBlock) {
+            return ::operator new(bytes);
+        }
+
+        FreeBlock *&list = freeLists[sizeClass(bytes)];
+        if (list) {
+            FreeBlock *block = list;
+            list = block->next;
+
+            return block;
+        }
+
+        size_t size = (sizeClass(bytes) + 1) * granularity;
+        if ((size_t)(end - cursor) < size) {
+            chunks.emplace_back(new char[chunkSize]);
+            cursor = chunks.back().get();
+            end = cursor + chunkSize;
+        }
+
+        void *block = cursor;
+        cursor += size;
+
+        return block;
+    }
+
+    void deallocate(void *p, size_t bytes) {
+        if (bytes > maxBlock) {
+            ::operator delete(p);
+        } else {
+            FreeBlock *&list = freeLists[sizeClass(bytes)];
+            list = new (p) FreeBlock{list};
+        }
+
+        if (--live == 0 && released) {
+            delete this;
+        }
+    }
+};
+
+template <typename U>
+class PoolAllocator {
+    template <typename V>
+    friend class PoolAllocator;
+
+    NodePool *pool;
+
+  public:
+    using value_type = U;
+
+    explicit PoolAllocator(NodePool *pool) : pool(pool) {}
+
+    template <typename V>
+    PoolAllocator(const PoolAllocator<V> &other) : pool(other.pool) {}
+
+    U *allocate(size_t n) {
+        static_assert(alignof(U) <= alignof(std::max_align_t));
+
+        return (U *)pool->allocate(n * sizeof(U));
+    }
+
+    void deallocate(U *p, size_t n) {
+        pool->deallocate(p, n * sizeof(U));
+    }
+
+    template <typename V>
+    bool operator==(const PoolAllocator<V> &other) const {
+        return pool == other.pool;
+    }
+    template <typename V>
+    bool operator!=(const PoolAllocator<V> &other) const {
+        return pool != other.pool;
+    }
+};
+
+#endif
@@ -2,6 +2,7 @@
 #define OPS
 
 #include <cmath>
+#include <cstdint>
 #include <iostream>
 #include <memory>
 
@@ -11,6 +12,39 @@ class Buffer;
 template <typename T>
 using BufferPtr = std::shared_ptr<Buffer<T>>;
 
+// stable identifiers for each operation type, used when a tape is written
+// to disk. values must never be reordered
+enum class OpCode : uint8_t {
+    Constant = 0,
+    Multiply = 1,
+    Divide = 2,
+    Add = 3,
+    Subtract = 4,
+    Power = 5,
+    Loop = 6,
+};
+
+inline const char *opName(OpCode code) {
+    switch (code) {
+        case OpCode::Constant:
+            return "Constant";
+        case OpCode::Multiply:
+            return "Multiply";
+        case OpCode::Divide:
+            return "Divide";
+        case OpCode::Add:
+            return "Add";
+        case OpCode::Subtract:
+            return "Subtract";
+        case OpCode::Power:
+            return "Power";
+        case OpCode::Loop:
+            return "Loop";
+    }
+
+    return "Unknown";
+}
+
 // TODO: take more than just binary operations
 template <typename T>
 class Operation {
@@ -22,12 +56,31 @@ class Operation {
 
   public:
     Operation(BufferPtr<T> lh, BufferPtr<T> rh, BufferPtr<T> out)
-        : lhOperand(lh), rhOperand(rh), output(out) {}
+        : lhOperand(std::move(lh)),
+          rhOperand(std::move(rh)),
+          output(std::move(out)) {}
     virtual void compute() = 0;
     virtual T differentiate(T u, T du, T v, T dv) = 0;
     virtual bool isConstant() {
         return false;
     }
+    virtual OpCode getOpCode() = 0;
+
+    // whether differentiate() looks at u and v, i.e. whether the operand
+    // values must survive until the gradient is taken
+    virtual bool differentiateUsesOperands() {
+        return true;
+    }
+
+    const BufferPtr<T> &getLhOperand() {
+        return lhOperand;
+    }
+    const BufferPtr<T> &getRhOperand() {
+        return rhOperand;
+    }
+    const BufferPtr<T> &getOutput() {
+        return output;
+    }
 
     T getOutputValue() {
         return output->getValue();
@@ -44,10 +97,7 @@ class Operation {
 template <typename T>
 class Constant : public Operation<T> {
   public:
-    Constant(BufferPtr<T> lh) : Operation<T>(lh, nullptr, lh) {
-        this->lhOperand = lh;
-        this->output = lh;
-    }
+    Constant(BufferPtr<T> lh) : Operation<T>(lh, nullptr, lh) {}
 
     void compute() {
         T value = this->lhOperand->getValue();
@@ -55,6 +105,14 @@ class Constant : public Operation<T> {
         this->output->setValue(value);
     }
 
+    OpCode getOpCode() {
+        return OpCode::Constant;
+    }
+
+    bool differentiateUsesOperands() {
+        return false;
+    }
+
     T differentiate(T u, T du, T v, T dv) {
         return 0;
     }
@@ -68,11 +126,7 @@ template <typename T>
 class Multiply : public Operation<T> {
   public:
     Multiply(BufferPtr<T> lh, BufferPtr<T> rh, BufferPtr<T> out)
-        : Operation<T>(lh, rh, out) {
-        this->lhOperand = lh;
-        this->rhOperand = rh;
-        this->output = out;
-    }
+        : Operation<T>(std::move(lh), std::move(rh), std::move(out)) {}
 
     void compute() {
         T value = this->lhOperand->getValue() * this->rhOperand->getValue();
@@ -80,6 +134,10 @@ class Multiply : public Operation<T> {
         this->output->setValue(value);
     }
 
+    OpCode getOpCode() {
+        return OpCode::Multiply;
+    }
+
     T differentiate(T u, T du, T v, T dv) {
         return du * v + u * dv;
     }
@@ -89,11 +147,7 @@ template <typename T>
 class Divide : public Operation<T> {
   public:
     Divide(BufferPtr<T> lh, BufferPtr<T> rh, BufferPtr<T> out)
-        : Operation<T>(lh, rh, out) {
-        this->lhOperand = lh;
-        this->rhOperand = rh;
-        this->output = out;
-    }
+        : Operation<T>(std::move(lh), std::move(rh), std::move(out)) {}
 
     void compute() {
         T value = this->lhOperand->getValue() / this->rhOperand->getValue();
@@ -101,6 +155,10 @@ class Divide : public Operation<T> {
         this->output->setValue(value);
     }
 
+    OpCode getOpCode() {
+        return OpCode::Divide;
+    }
+
     T differentiate(T u, T du, T v, T dv) {
         return (du * v - u * dv) / (v * v);
     }
@@ -110,11 +168,7 @@ template <typename T>
 class Add : public Operation<T> {
   public:
     Add(BufferPtr<T> lh, BufferPtr<T> rh, BufferPtr<T> out)
-        : Operation<T>(lh, rh, out) {
-        this->lhOperand = lh;
-        this->rhOperand = rh;
-        this->output = out;
-    }
+        : Operation<T>(std::move(lh), std::move(rh), std::move(out)) {}
 
     void compute() {
         T value = this->lhOperand->getValue() + this->rhOperand->getValue();
@@ -122,6 +176,14 @@ class Add : public Operation<T> {
         this->output->setValue(value);
     }
 
+    OpCode getOpCode() {
+        return OpCode::Add;
+    }
+
+    bool differentiateUsesOperands() {
+        return false;
+    }
+
     T differentiate(T u, T du, T v, T dv) {
         return du + dv;
     }
@@ -131,11 +193,7 @@ template <typename T>
 class Subtract : public Operation<T> {
   public:
     Subtract(BufferPtr<T> lh, BufferPtr<T> rh, BufferPtr<T> out)
-        : Operation<T>(lh, rh, out) {
-        this->lhOperand = lh;
-        this->rhOperand = rh;
-        this->output = out;
-    }
+        : Operation<T>(std::move(lh), std::move(rh), std::move(out)) {}
 
     void compute() {
         T value = this->lhOperand->getValue() - this->rhOperand->getValue();
@@ -143,6 +201,14 @@ class Subtract : public Operation<T> {
         this->output->setValue(value);
     }
 
+    OpCode getOpCode() {
+        return OpCode::Subtract;
+    }
+
+    bool differentiateUsesOperands() {
+        return false;
+    }
+
     T differentiate(T u, T du, T v, T dv) {
         return du - dv;
     }
@@ -152,11 +218,7 @@ template <typename T>
 class Power : public Operation<T> {
   public:
     Power(BufferPtr<T> lh, BufferPtr<T> rh, BufferPtr<T> out)
-        : Operation<T>(lh, rh, out) {
-        this->lhOperand = lh;
-        this->rhOperand = rh;
-        this->output = out;
-    }
+        : Operation<T>(std::move(lh), std::move(rh), std::move(out)) {}
 
     void compute() {
         T value = pow(this->lhOperand->getValue(), this->rhOperand->getValue());
@@ -164,6 +226,10 @@ class Power : public Operation<T> {
         this->output->setValue(value);
     }
 
+    OpCode getOpCode() {
+        return OpCode::Power;
+    }
+
     T differentiate(T u, T du, T v, T dv) {
         // d/dx(a^b)
         if (du == 0 && dv == 0) {
@@ -187,4 +253,30 @@ class Power : public Operation<T> {
     }
 };
 
+// rebuilds an operation from its serialized form
+template <typename T>
+std::shared_ptr<Operation<T>> makeOperation(OpCode code, BufferPtr<T> lh,
+                                            BufferPtr<T> rh,
+                                            BufferPtr<T> out) {
+    switch (code) {
+        case OpCode::Constant:
+            return std::make_shared<Constant<T>>(lh);
+        case OpCode::Multiply:
+            return std::make_shared<Multiply<T>>(lh, rh, out);
+        case OpCode::Divide:
+            return std::make_shared<Divide<T>>(lh, rh, out);
+        case OpCode::Add:
+            return std::make_shared<Add<T>>(lh, rh, out);
+        case OpCode::Subtract:
+            return std::make_shared<Subtract<T>>(lh, rh, out);
+        case OpCode::Power:
+            return std::make_shared<Power<T>>(lh, rh, out);
+        // the loop body is a separate tape that isn't serialized
+        case OpCode::Loop:
+            return nullptr;
+    }
+
+    return nullptr;
+}
+
 #endif
@@ -0,0 +1,181 @@
+#ifndef PROFILER
+#define PROFILER
+
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <map>
+#include <ostream>
+#include <vector>
+
+#include "ops.h"
+
+// per-tape instrumentation. everything is off by default and every hook is
+// guarded by isEnabled(), so a disabled profiler costs one branch per node
+class Profiler {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    struct OpStats {
+        int64_t nodes = 0;
+        int64_t forwardCalls = 0;
+        int64_t forwardNs = 0;
+        int64_t backwardCalls = 0;
+        int64_t backwardNs = 0;
+    };
+
+  private:
+    // nodes is -1 for single operations
+    struct TraceEvent {
+        const char *name;
+        const char *category;
+        int64_t startNs;
+        int64_t durationNs;
+        int64_t nodes;
+    };
+
+    bool enabled = false;
+    Clock::time_point origin = Clock::now();
+
+    std::map<OpCode, OpStats> ops;
+    int64_t nodes = 0;
+    int64_t bytes = 0;
+
+    // filled by Tape::recordShape, -1 until then
+    int depth = -1;
+    int width = -1;
+
+    std::vector<TraceEvent> events;
+
+    int64_t sinceOrigin(Clock::time_point t) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(t - origin)
+            .count();
+    }
+
+  public:
+    bool isEnabled() {
+        return enabled;
+    }
+    void setEnabled(bool enabled) {
+        this->enabled = enabled;
+    }
+
+    void reset() {
+        ops.clear();
+        nodes = 0;
+        bytes = 0;
+        depth = -1;
+        width = -1;
+        events.clear();
+        origin = Clock::now();
+    }
+
+    void recordNode(OpCode code, int64_t nodeBytes) {
+        ops[code].nodes++;
+        nodes++;
+        bytes += nodeBytes;
+    }
+
+    void recordAllocation(int64_t allocated) {
+        bytes += allocated;
+    }
+
+    void recordForward(OpCode code, Clock::time_point start,
+                       Clock::time_point end) {
+        int64_t startNs = sinceOrigin(start);
+        int64_t durationNs = sinceOrigin(end) - startNs;
+
+        OpStats &stats = ops[code];
+        stats.forwardCalls++;
+        stats.forwardNs += durationNs;
+        events.push_back({opName(code), "forward", startNs, durationNs, -1});
+    }
+
+    void recordBackward(OpCode code, Clock::time_point start,
+                        Clock::time_point end) {
+        int64_t startNs = sinceOrigin(start);
+        int64_t durationNs = sinceOrigin(end) - startNs;
+
+        OpStats &stats = ops[code];
+        stats.backwardCalls++;
+        stats.backwardNs += durationNs;
+        events.push_back({opName(code), "backward", startNs, durationNs, -1});
+    }
+
+    // one complete event per compute/gradient call for the chrome trace.
+    // the operations it ran show up nested inside it
+    void recordEvent(const char *name, Clock::time_point start,
+                     Clock::time_point end, int64_t visited) {
+        int64_t startNs = sinceOrigin(start);
+        events.push_back(
+            {name, "call", startNs, sinceOrigin(end) - startNs, visited});
+    }
+
+    void recordShape(int depth, int width) {
+        this->depth = depth;
+        this->width = width;
+    }
+
+    const std::map<OpCode, OpStats> &getOpStats() {
+        return ops;
+    }
+    int64_t getNodeCount() {
+        return nodes;
+    }
+    int64_t getBytes() {
+        return bytes;
+    }
+    int getDepth() {
+        return depth;
+    }
+    int getWidth() {
+        return width;
+    }
+
+    void writeJson(std::ostream &os) {
+        os << "{\"nodes\": " << nodes << ", \"bytes\": " << bytes
+           << ", \"depth\": " << depth << ", \"width\": " << width
+           << ", \"ops\": {";
+
+        bool first = true;
+        for (auto &[code, stats] : ops) {
+            os << (first ? "" : ", ") << "\"" << opName(code) << "\": {"
+               << "\"nodes\": " << stats.nodes
+               << ", \"forwardCalls\": " << stats.forwardCalls
+               << ", \"forwardNs\": " << stats.forwardNs
+               << ", \"backwardCalls\": " << stats.backwardCalls
+               << ", \"backwardNs\": " << stats.backwardNs << "}";
+            first = false;
+        }
+
+        os << "}}" << std::endl;
+    }
+
+    // chrome://tracing / perfetto "trace event" format, times in us with
+    // ns resolution kept as three fixed decimals
+    void writeChromeTrace(std::ostream &os) {
+        std::ios_base::fmtflags flags = os.flags();
+        std::streamsize precision = os.precision();
+        os << std::fixed << std::setprecision(3) << "{\"traceEvents\": [";
+
+        bool first = true;
+        for (auto &event : events) {
+            os << (first ? "" : ",") << "\n  {\"name\": \"" << event.name
+               << "\", \"cat\": \"" << event.category
+               << "\", \"ph\": \"X\", \"pid\": 0, \"tid\": 0, \"ts\": "
+               << event.startNs / 1000.0
+               << ", \"dur\": " << event.durationNs / 1000.0;
+            if (event.nodes >= 0) {
+                os << ", \"args\": {\"nodes\": " << event.nodes << "}";
+            }
+            os << "}";
+            first = false;
+        }
+
+        os << "\n]}" << std::endl;
+        os.flags(flags);
+        os.precision(precision);
+    }
+};
+
+#endif
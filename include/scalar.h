@@ -17,19 +17,26 @@ class Scalar {
 
   public:
     Scalar() {
-        value = std::shared_ptr<Buffer<T>>(new Buffer<T>());
+        value = std::make_shared<Buffer<T>>();
     }
 
     Scalar(T v) {
-        value = std::shared_ptr<Buffer<T>>(new Buffer<T>());
+        value = std::make_shared<Buffer<T>>();
         value->setValue(v);
     }
 
-    void setValue(T newValue) {
+    Scalar(std::shared_ptr<Buffer<T>> buffer) : value(std::move(buffer)) {}
+
+    Scalar(const Scalar<T> &s) = default;
+    Scalar(Scalar<T> &&s) noexcept = default;
+
+    virtual ~Scalar() {}
+
+    virtual void setValue(T newValue) {
         value->setValue(newValue);
     }
     void operator=(T newValue) {
-        value->setValue(newValue);
+        setValue(newValue);
     }
 
     friend std::ostream &operator<<(std::ostream &os, const Scalar &s) {
@@ -0,0 +1,300 @@
+#ifndef SERIALIZATION
+#define SERIALIZATION
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "gradient.h"
+
+// on-disk layout of a tape. integers are native-endian, so files are only
+// portable between machines with the same byte order
+//
+//   TapeFileHeader
+//   TapeFileNode[nodeCount]
+//   int32_t[edgeCount]      edge targets, grouped by source node
+//   T[slotCount]            values, starting at valuesOffset
+//
+// every buffer on the tape becomes one value slot. loading maps the file
+// privately and points each buffer at its slot, so values are used in place
+// and writes (compute, setValue) never reach the file
+
+const char TAPE_MAGIC[4] = {'R', 'P', 'L', 'T'};
+const uint32_t TAPE_VERSION = 1;
+const uint64_t TAPE_VALUE_ALIGNMENT = 64;
+
+struct TapeFileHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t valueSize;
+    uint32_t nodeCount;
+    uint32_t edgeCount;
+    uint32_t slotCount;
+    uint64_t valuesOffset;
+};
+
+struct TapeFileNode {
+    uint8_t opCode;
+    uint8_t padding[3];
+    int32_t lhSlot;
+    int32_t rhSlot;
+    int32_t outSlot;
+    uint32_t edgeBegin;
+    uint32_t edgeCount;
+};
+
+// streaming tapes that have already retired nodes can't be saved, since
+// their edges point at nodes that no longer exist. neither can tapes with
+// loops, whose bodies live on tapes of their own
+template <typename T>
+bool saveTape(Tape<T> &tape, const std::string &path) {
+    if (tape.getFirstId() != 0) {
+        return false;
+    }
+
+    std::unordered_map<Buffer<T> *, int32_t> slotMap;
+    std::vector<BufferPtr<T>> slots;
+
+    auto slotOf = [&](BufferPtr<T> buffer) -> int32_t {
+        if (!buffer) {
+            return -1;
+        }
+
+        auto it = slotMap.find(buffer.get());
+        if (it != slotMap.end()) {
+            return it->second;
+        }
+
+        int32_t slot = slots.size();
+        slotMap[buffer.get()] = slot;
+        slots.push_back(buffer);
+
+        return slot;
+    };
+
+    int nodeCount = tape.getNodeCount();
+    std::vector<TapeFileNode> fileNodes(nodeCount);
+    std::vector<int32_t> edges;
+
+    for (int id = 0; id < nodeCount; id++) {
+        OpPtr<T> op = tape.getNode(id)->getOp();
+        TapeFileNode &fileNode = fileNodes[id];
+
+        if (op->getOpCode() == OpCode::Loop) {
+            return false;
+        }
+
+        memset(&fileNode, 0, sizeof(fileNode));
+        fileNode.opCode = (uint8_t)op->getOpCode();
+        fileNode.lhSlot = slotOf(op->getLhOperand());
+        fileNode.rhSlot = slotOf(op->getRhOperand());
+        fileNode.outSlot = slotOf(op->getOutput());
+        fileNode.edgeBegin = edges.size();
+
+        for (auto edge : tape.getEdges(id)) {
+            edges.push_back(edge->getId());
+        }
+
+        fileNode.edgeCount = edges.size() - fileNode.edgeBegin;
+    }
+
+    TapeFileHeader header;
+    memcpy(header.magic, TAPE_MAGIC, sizeof(header.magic));
+    header.version = TAPE_VERSION;
+    header.valueSize = sizeof(T);
+    header.nodeCount = nodeCount;
+    header.edgeCount = edges.size();
+    header.slotCount = slots.size();
+
+    uint64_t end = sizeof(header) + fileNodes.size() * sizeof(TapeFileNode) +
+                   edges.size() * sizeof(int32_t);
+    header.valuesOffset = (end + TAPE_VALUE_ALIGNMENT - 1) /
+                          TAPE_VALUE_ALIGNMENT * TAPE_VALUE_ALIGNMENT;
+
+    std::vector<T> values(slots.size());
+    for (size_t i = 0; i < slots.size(); i++) {
+        values[i] = slots[i]->getValue();
+    }
+
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+
+    std::vector<char> padding(header.valuesOffset - end, 0);
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = ok && fwrite(fileNodes.data(), sizeof(TapeFileNode),
+                      fileNodes.size(), file) == fileNodes.size();
+    ok = ok && fwrite(edges.data(), sizeof(int32_t), edges.size(), file) ==
+                   edges.size();
+    ok = ok && fwrite(padding.data(), 1, padding.size(), file) ==
+                   padding.size();
+    ok = ok && fwrite(values.data(), sizeof(T), values.size(), file) ==
+                   values.size();
+
+    return fclose(file) == 0 && ok;
+}
+
+// whether the edges read from a file form a dag. compute would never finish
+// on a cycle. edges have already been bounds checked
+inline bool tapeFileAcyclic(const TapeFileNode *fileNodes,
+                            const int32_t *edges, uint32_t nodeCount) {
+    // 0 unvisited, 1 on the current path, 2 finished
+    std::vector<uint8_t> colour(nodeCount, 0);
+    std::vector<std::pair<uint32_t, uint32_t>> s;
+
+    for (uint32_t root = 0; root < nodeCount; root++) {
+        if (colour[root] != 0) {
+            continue;
+        }
+
+        colour[root] = 1;
+        s.emplace_back(root, 0);
+        while (!s.empty()) {
+            auto &[id, index] = s.back();
+            const TapeFileNode &fileNode = fileNodes[id];
+
+            if (index == fileNode.edgeCount) {
+                colour[id] = 2;
+                s.pop_back();
+                continue;
+            }
+
+            int32_t to = edges[fileNode.edgeBegin + index++];
+            if (colour[to] == 1) {
+                return false;
+            }
+            if (colour[to] == 0) {
+                colour[to] = 1;
+                s.emplace_back(to, 0);
+            }
+        }
+    }
+
+    return true;
+}
+
+// returns nullptr if the file is missing, truncated, has a cycle or was
+// written for a different value type or format version
+template <typename T>
+TapePtr<T> loadTape(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 ||
+        (size_t)info.st_size < sizeof(TapeFileHeader)) {
+        close(fd);
+        return nullptr;
+    }
+
+    size_t size = info.st_size;
+    void *address =
+        mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (address == MAP_FAILED) {
+        return nullptr;
+    }
+
+    // buffers alias this mapping, so it stays alive as long as any of them
+    std::shared_ptr<char> mapping(
+        (char *)address, [size](char *p) { munmap(p, size); });
+
+    const char *base = mapping.get();
+    const TapeFileHeader *header = (const TapeFileHeader *)base;
+
+    if (memcmp(header->magic, TAPE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != TAPE_VERSION || header->valueSize != sizeof(T)) {
+        return nullptr;
+    }
+
+    uint64_t nodesEnd = sizeof(TapeFileHeader) +
+                        (uint64_t)header->nodeCount * sizeof(TapeFileNode);
+    uint64_t edgesEnd =
+        nodesEnd + (uint64_t)header->edgeCount * sizeof(int32_t);
+    uint64_t valuesEnd =
+        header->valuesOffset + (uint64_t)header->slotCount * sizeof(T);
+
+    if (edgesEnd > header->valuesOffset || valuesEnd > size ||
+        header->valuesOffset % alignof(T) != 0) {
+        return nullptr;
+    }
+
+    const TapeFileNode *fileNodes =
+        (const TapeFileNode *)(base + sizeof(TapeFileHeader));
+    const int32_t *edges = (const int32_t *)(base + nodesEnd);
+    T *values = (T *)(base + header->valuesOffset);
+
+    std::vector<BufferPtr<T>> slots(header->slotCount);
+    for (uint32_t i = 0; i < header->slotCount; i++) {
+        slots[i] = std::make_shared<Buffer<T>>(
+            std::shared_ptr<T>(mapping, values + i));
+    }
+
+    auto slotAt = [&](int32_t slot) -> BufferPtr<T> {
+        if (slot < 0 || (uint32_t)slot >= header->slotCount) {
+            return nullptr;
+        }
+
+        return slots[slot];
+    };
+
+    TapePtr<T> tape(new Tape<T>());
+    for (uint32_t id = 0; id < header->nodeCount; id++) {
+        const TapeFileNode &fileNode = fileNodes[id];
+        OpPtr<T> op = makeOperation((OpCode)fileNode.opCode,
+                                    slotAt(fileNode.lhSlot),
+                                    slotAt(fileNode.rhSlot),
+                                    slotAt(fileNode.outSlot));
+
+        if (!op || !op->getLhOperand() || !op->getOutput() ||
+            (!op->isConstant() && !op->getRhOperand())) {
+            return nullptr;
+        }
+
+        tape->createNode(op);
+    }
+
+    for (uint32_t id = 0; id < header->nodeCount; id++) {
+        const TapeFileNode &fileNode = fileNodes[id];
+        if ((uint64_t)fileNode.edgeBegin + fileNode.edgeCount >
+            header->edgeCount) {
+            return nullptr;
+        }
+
+        for (uint32_t i = 0; i < fileNode.edgeCount; i++) {
+            int32_t to = edges[fileNode.edgeBegin + i];
+            if (to < 0 || (uint32_t)to >= header->nodeCount) {
+                return nullptr;
+            }
+        }
+    }
+
+    if (!tapeFileAcyclic(fileNodes, edges, header->nodeCount)) {
+        return nullptr;
+    }
+
+    for (uint32_t id = 0; id < header->nodeCount; id++) {
+        const TapeFileNode &fileNode = fileNodes[id];
+        for (uint32_t i = 0; i < fileNode.edgeCount; i++) {
+            tape->addEdge(id, edges[fileNode.edgeBegin + i]);
+        }
+    }
+
+    return tape;
+}
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef SPARSE
+#define SPARSE
+
+#include <cmath>
+#include <unordered_map>
+#include <vector>
+
+#include "matrix.h"
+
+// gradient of an embedding table, kept only for the rows a batch touched.
+// row k of values belongs to table row rows[k]
+template <typename T>
+class SparseGradient {
+    std::unordered_map<int, int> slotOf;
+
+  public:
+    int cols;
+    std::vector<int> rows;
+    std::vector<T> values;
+
+    SparseGradient(int cols) : cols(cols) {}
+
+    // adds g (cols values) onto the gradient of table row
+    void add(int row, const T *g) {
+        auto [it, inserted] = slotOf.emplace(row, rows.size());
+        if (inserted) {
+            rows.push_back(row);
+            values.resize(values.size() + cols);
+        }
+
+        T *out = &values[(size_t)it->second * cols];
+        for (int j = 0; j < cols; j++) {
+            out[j] += g[j];
+        }
+    }
+
+    const T *row(int k) const {
+        return &values[(size_t)k * cols];
+    }
+
+    int size() const {
+        return rows.size();
+    }
+};
+
+// both optimizers only visit the rows in the gradient, so an update costs
+// the same however large the table is
+
+template <typename T>
+void sgdUpdate(Matrix<T> &table, const SparseGradient<T> &grad,
+               T learningRate) {
+    for (int k = 0; k < grad.size(); k++) {
+        T *out = &table(grad.rows[k], 0);
+        const T *g = grad.row(k);
+
+        for (int j = 0; j < table.cols; j++) {
+            out[j] -= learningRate * g[j];
+        }
+    }
+}
+
+// per-coordinate step sizes from the running sum of squared gradients. the
+// sums are a table-sized Matrix allocated once up front
+template <typename T>
+class SparseAdagrad {
+    Matrix<T> squares;
+    T learningRate;
+    T eps;
+
+  public:
+    SparseAdagrad(const Matrix<T> &table, T learningRate, T eps = 1e-8)
+        : squares(table.rows, table.cols),
+          learningRate(learningRate),
+          eps(eps) {}
+
+    void update(Matrix<T> &table, const SparseGradient<T> &grad) {
+        for (int k = 0; k < grad.size(); k++) {
+            T *out = &table(grad.rows[k], 0);
+            T *sum = &squares(grad.rows[k], 0);
+            const T *g = grad.row(k);
+
+            for (int j = 0; j < table.cols; j++) {
+                sum[j] += g[j] * g[j];
+                out[j] -= learningRate * g[j] / (std::sqrt(sum[j]) + eps);
+            }
+        }
+    }
+};
+
+#endif
@@ -34,19 +34,30 @@ class Variable : public Scalar<T> {
     int nodeId;
 
   public:
-    Variable(T value, Tape<T> *tape) : Scalar<T>(value) {
+    // the buffer comes from the tape's pool, like the node recorded for it
+    Variable(T value, Tape<T> *tape)
+        : Scalar<T>(tape->template make<Buffer<T>>()) {
+        this->value->setValue(value);
         this->tape = TapePtr<T>(tape);
         nodeId = tape->addVariable(this);
     }
 
-    Variable(T value, TapePtr<T> tape) : Scalar<T>(value) {
-        this->tape = tape;
-        nodeId = tape->addVariable(this);
+    Variable(T value, TapePtr<T> tape)
+        : Scalar<T>(tape->template make<Buffer<T>>()), tape(std::move(tape)) {
+        this->value->setValue(value);
+        nodeId = this->tape->addVariable(this);
     }
 
-    Variable(TapePtr<T> tape) : Scalar<T>() {
-        this->tape = tape;
-        nodeId = tape->addVariable(this);
+    Variable(TapePtr<T> tape)
+        : Scalar<T>(tape->template make<Buffer<T>>()), tape(std::move(tape)) {
+        nodeId = this->tape->addVariable(this);
+    }
+
+    // refers to a node already on the tape, e.g. one loaded from disk
+    Variable(TapePtr<T> tape, int nodeId)
+        : Scalar<T>(tape->getNode(nodeId)->getOp()->getOutput()) {
+        this->tape = std::move(tape);
+        this->nodeId = nodeId;
     }
 
     Variable(const Variable<T> &v) : Scalar<T>(v) {
@@ -54,6 +65,10 @@ class Variable : public Scalar<T> {
         nodeId = v.nodeId;
     }
 
+    // steals the references instead of bumping them
+    Variable(Variable<T> &&v) noexcept
+        : Scalar<T>(std::move(v)), tape(std::move(v.tape)), nodeId(v.nodeId) {}
+
     friend void swap(Variable<T> &lh, Variable<T> &rh) {
         using std::swap;
 
@@ -62,33 +77,40 @@ class Variable : public Scalar<T> {
         swap(lh.value, rh.value);
     }
 
+    // rh is moved in when assigning from a temporary
     Variable<T> &operator=(Variable<T> rh) {
         swap(*this, rh);
 
         return *this;
     }
 
-    TapePtr<T> getTape() {
+    const TapePtr<T> &getTape() const {
         return tape;
     }
 
-    std::shared_ptr<Buffer<T>> getBuffer() {
+    const std::shared_ptr<Buffer<T>> &getBuffer() const {
         return this->value;
     }
 
-    int getNodeId() {
+    int getNodeId() const {
         return nodeId;
     }
 
-    T getValue() {
+    T getValue() const {
         return this->value->getValue();
     }
+
+    // lets the tape recompute only what depends on this value
+    void setValue(T newValue) override {
+        Scalar<T>::setValue(newValue);
+        tape->markDirty(nodeId);
+    }
 };
 
 template <typename T>
-void opOverload(int nodeId1, int nodeId2, TapePtr<T> t, Operation<T> *op,
+void opOverload(int nodeId1, int nodeId2, const TapePtr<T> &t, OpPtr<T> op,
                 int outputNodeId) {
-    t->createNode(op);
+    t->createNode(std::move(op));
 
     int lastId = t->getLastId();
     t->addEdge(lastId, nodeId1);
@@ -97,144 +119,125 @@ void opOverload(int nodeId1, int nodeId2, TapePtr<T> t, Operation<T> *op,
     t->addEdge(outputNodeId, lastId);
 }
 
+// operators take const references so temporaries chain, e.g.
+// v * v2 * v3 * s1 * pi. the output Variable is built in place and returned
+// by value, constant operands live on the stack until the op holds their
+// buffer. the output buffer, operation and nodes all come from the tape's
+// pool
+
 template <typename T>
-Variable<T> operator*(Variable<T> &v1, Variable<T> &v2) {
-    TapePtr<T> tape = v1.getTape();
-    VarPtr<T> output(new Variable<T>(tape));
-    Multiply<T> *op =
-        new Multiply<T>(v1.getBuffer(), v2.getBuffer(), output->getBuffer());
+Variable<T> operator*(const Variable<T> &v1, const Variable<T> &v2) {
+    const TapePtr<T> &tape = v1.getTape();
+    Variable<T> output(tape);
+    OpPtr<T> op = tape->template make<Multiply<T>>(
+        v1.getBuffer(), v2.getBuffer(), output.getBuffer());
 
-    opOverload(v1.getNodeId(), v2.getNodeId(), tape, op, output->getNodeId());
+    opOverload(v1.getNodeId(), v2.getNodeId(), tape, std::move(op),
+               output.getNodeId());
 
-    return *output;
+    return output;
 }
 
 template <typename T>
-Variable<T> operator*(Variable<T> &v1, T v2) {
-    TapePtr<T> tape = v1.getTape();
-    VarPtr<T> rhVar(new Variable<T>(v2, tape));
-
-    return v1 * (*rhVar);
+Variable<T> operator*(const Variable<T> &v1, T v2) {
+    return v1 * Variable<T>(v2, v1.getTape());
 }
 
 template <typename T>
-Variable<T> operator*(T &v1, Variable<T> &v2) {
-    TapePtr<T> tape = v1.getTape();
-    VarPtr<T> lhVar(new Variable<T>(v1, tape));
-
-    return (*lhVar) * v2;
+Variable<T> operator*(T v1, const Variable<T> &v2) {
+    return Variable<T>(v1, v2.getTape()) * v2;
 }
 
 template <typename T>
-Variable<T> operator+(Variable<T> &v1, Variable<T> &v2) {
-    TapePtr<T> tape = v1.getTape();
-    VarPtr<T> output(new Variable<T>(tape));
-    Add<T> *op =
-        new Add<T>(v1.getBuffer(), v2.getBuffer(), output->getBuffer());
+Variable<T> operator+(const Variable<T> &v1, const Variable<T> &v2) {
+    const TapePtr<T> &tape = v1.getTape();
+    Variable<T> output(tape);
+    OpPtr<T> op = tape->template make<Add<T>>(
+        v1.getBuffer(), v2.getBuffer(), output.getBuffer());
 
-    opOverload(v1.getNodeId(), v2.getNodeId(), tape, op, output->getNodeId());
+    opOverload(v1.getNodeId(), v2.getNodeId(), tape, std::move(op),
+               output.getNodeId());
 
-    return *output;
+    return output;
 }
 
 template <typename T>
-Variable<T> operator+(Variable<T> &v1, T v2) {
-    TapePtr<T> tape = v1.getTape();
-    VarPtr<T> rhVar(new Variable<T>(v2, tape));
-
-    return v1 + (*rhVar);
+Variable<T> operator+(const Variable<T> &v1, T v2) {
+    return v1 + Variable<T>(v2, v1.getTape());
 }
 
 template <typename T>
-Variable<T> operator+(T &v1, Variable<T> &v2) {
-    TapePtr<T> tape = v1.getTape();
-    VarPtr<T> lhVar(new Variable<T>(v1, tape));
-
-    return (*lhVar) + v2;
+Variable<T> operator+(T v1, const Variable<T> &v2) {
+    return Variable<T>(v1, v2.getTape()) + v2;
 }
 
 template <typename T>
-Variable<T> operator-(Variable<T> &v1, Variable<T> &v2) {
-    TapePtr<T> tape = v1.getTape();
-    VarPtr<T> output(new Variable<T>(tape));
-    Subtract<T> *op =
-        new Subtract<T>(v1.getBuffer(), v2.getBuffer(), output->getBuffer());
+Variable<T> operator-(const Variable<T> &v1, const Variable<T> &v2) {
+    const TapePtr<T> &tape = v1.getTape();
+    Variable<T> output(tape);
+    OpPtr<T> op = tape->template make<Subtract<T>>(
+        v1.getBuffer(), v2.getBuffer(), output.getBuffer());
 
-    opOverload(v1.getNodeId(), v2.getNodeId(), tape, op, output->getNodeId());
+    opOverload(v1.getNodeId(), v2.getNodeId(), tape, std::move(op),
+               output.getNodeId());
 
-    return *output;
+    return output;
 }
 
 template <typename T>
-Variable<T> operator-(Variable<T> &v1, T v2) {
-    TapePtr<T> tape = v1.getTape();
-    VarPtr<T> rhVar(new Variable<T>(v2, tape));
-
-    return v1 - (*rhVar);
+Variable<T> operator-(const Variable<T> &v1, T v2) {
+    return v1 - Variable<T>(v2, v1.getTape());
 }
 
 template <typename T>
-Variable<T> operator-(T &v1, Variable<T> &v2) {
-    TapePtr<T> tape = v1.getTape();
-    VarPtr<T> lhVar(new Variable<T>(v1, tape));
-
-    return (*lhVar) - v2;
+Variable<T> operator-(T v1, const Variable<T> &v2) {
+    return Variable<T>(v1, v2.getTape()) - v2;
 }
 
 template <typename T>
-Variable<T> operator/(Variable<T> &v1, Variable<T> &v2) {
-    TapePtr<T> tape = v1.getTape();
-    VarPtr<T> output(new Variable<T>(tape));
-    Divide<T> *op =
-        new Divide<T>(v1.getBuffer(), v2.getBuffer(), output->getBuffer());
+Variable<T> operator/(const Variable<T> &v1, const Variable<T> &v2) {
+    const TapePtr<T> &tape = v1.getTape();
+    Variable<T> output(tape);
+    OpPtr<T> op = tape->template make<Divide<T>>(
+        v1.getBuffer(), v2.getBuffer(), output.getBuffer());
 
-    opOverload(v1.getNodeId(), v2.getNodeId(), tape, op, output->getNodeId());
+    opOverload(v1.getNodeId(), v2.getNodeId(), tape, std::move(op),
+               output.getNodeId());
 
-    return *output;
+    return output;
 }
 
 template <typename T>
-Variable<T> operator/(Variable<T> &v1, T v2) {
-    TapePtr<T> tape = v1.getTape();
-    VarPtr<T> rhVar(new Variable<T>(v2, tape));
-
-    return v1 / (*rhVar);
+Variable<T> operator/(const Variable<T> &v1, T v2) {
+    return v1 / Variable<T>(v2, v1.getTape());
 }
 
 template <typename T>
-Variable<T> operator/(T &v1, Variable<T> &v2) {
-    TapePtr<T> tape = v1.getTape();
-    VarPtr<T> lhVar(new Variable<T>(v1, tape));
-
-    return (*lhVar) / v2;
+Variable<T> operator/(T v1, const Variable<T> &v2) {
+    return Variable<T>(v1, v2.getTape()) / v2;
 }
 
 template <typename T>
-Variable<T> operator^(Variable<T> &v1, Variable<T> &v2) {
-    TapePtr<T> tape = v1.getTape();
-    VarPtr<T> output(new Variable<T>(tape));
-    Power<T> *op =
-        new Power<T>(v1.getBuffer(), v2.getBuffer(), output->getBuffer());
+Variable<T> operator^(const Variable<T> &v1, const Variable<T> &v2) {
+    const TapePtr<T> &tape = v1.getTape();
+    Variable<T> output(tape);
+    OpPtr<T> op = tape->template make<Power<T>>(
+        v1.getBuffer(), v2.getBuffer(), output.getBuffer());
 
-    opOverload(v1.getNodeId(), v2.getNodeId(), tape, op, output->getNodeId());
+    opOverload(v1.getNodeId(), v2.getNodeId(), tape, std::move(op),
+               output.getNodeId());
 
-    return *output;
+    return output;
 }
 
 template <typename T>
-Variable<T> operator^(Variable<T> &v1, T v2) {
-    TapePtr<T> tape = v1.getTape();
-    VarPtr<T> rhVar(new Variable<T>(v2, tape));
-
-    return v1 ^ (*rhVar);
+Variable<T> operator^(const Variable<T> &v1, T v2) {
+    return v1 ^ Variable<T>(v2, v1.getTape());
 }
 
 template <typename T>
-Variable<T> operator^(T &v1, Variable<T> &v2) {
-    TapePtr<T> tape = v1.getTape();
-    VarPtr<T> lhVar(new Variable<T>(v1, tape));
-
-    return (*lhVar) ^ v2;
+Variable<T> operator^(T v1, const Variable<T> &v2) {
+    return Variable<T>(v1, v2.getTape()) ^ v2;
 }
 
 #endif
@@ -1,11 +1,21 @@
 #include <math.h>
 
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <vector>
 
+#include "data_parallel.h"
 #include "generation.h"
 #include "gradient.h"
+#include "jit.h"
+#include "local_tape.h"
+#include "loop.h"
+#include "memory_plan.h"
+#include "serialization.h"
 
 using namespace std;
 
@@ -16,12 +26,42 @@ void printVar(Variable<T> *v) {
 
 void basicGradientTest();
 void selfAssignmentTest();
+void parallelInitTest();
+void serializationTest();
+void loadRejectionTest();
+void streamingTest();
+void streamingSetValueTest();
+void profilerTest();
+void incrementalTest();
+void memoryPlanTest();
+void loopTest();
+void jitTest();
+void localTapeTest();
+void fusedOpsTest();
+void convTest();
+void embeddingTest();
+void dataParallelTest();
 
 int main() {
     srand(time(0));
 
     basicGradientTest();
     selfAssignmentTest();
+    parallelInitTest();
+    serializationTest();
+    loadRejectionTest();
+    streamingTest();
+    streamingSetValueTest();
+    profilerTest();
+    incrementalTest();
+    memoryPlanTest();
+    loopTest();
+    jitTest();
+    localTapeTest();
+    fusedOpsTest();
+    convTest();
+    embeddingTest();
+    dataParallelTest();
 
     return 0;
 }
@@ -40,10 +80,11 @@ void basicGradientTest() {
     auto v4 = v * v3;
     auto v5 = v4 ^ v3;
 
-    // NOTE: cannot do below because temporary objects are a headache.
-    // Variable<float> v4 = v * v2 * v3 * s1 * pi;
+    // temporaries bind to the operators, so expressions chain
+    auto v6 = v * v2 * v3 * s1 * pi;
 
     t->compute(&v5);
+    t->compute(&v6);
     cout << "v == ";
     printVar(&v);
     cout << "v2 == ";
@@ -54,6 +95,8 @@ void basicGradientTest() {
     printVar(&v4);
     cout << "v5 == ";
     printVar(&v5);
+    cout << "v6 == ";
+    printVar(&v6);
 
     const double f = v.getValue() * v3.getValue();
     const double f1 = v.getValue();
@@ -78,3 +121,632 @@ void selfAssignmentTest() {
     cout << "v^10 == ";
     printVar(&v);
 }
+
+void parallelInitTest() {
+    const size_t n = 1 << 20;
+    std::vector<double> serial(n), parallel(n);
+
+    heNormal(serial.data(), n, 512, 42, 1);
+    heNormal(parallel.data(), n, 512, 42, 4);
+
+    double mean = 0;
+    for (double x : parallel) {
+        mean += x;
+    }
+    mean /= n;
+
+    double variance = 0;
+    for (double x : parallel) {
+        variance += (x - mean) * (x - mean);
+    }
+    variance /= n;
+
+    bool identical =
+        memcmp(serial.data(), parallel.data(), n * sizeof(double)) == 0;
+
+    cout << "heNormal 1 thread vs 4 threads identical == "
+         << (identical ? "true" : "false") << endl;
+    cout << "heNormal variance:" << endl;
+    cout << "  - prediction == " << variance << endl;
+    cout << "  - actual     == " << 2.0 / 512 << endl;
+}
+
+void serializationTest() {
+    TapePtr<double> t(new Tape<double>());
+
+    Variable<double> s1(5, t);
+    Variable<double> pi(3.14, t);
+
+    auto v = s1 - pi;
+    auto v2 = v * s1;
+    auto v3 = v2 ^ pi;
+
+    t->compute(&v3);
+
+    const char *path = "/tmp/replicant_tape.bin";
+    if (!saveTape(*t, path)) {
+        cout << "saveTape failed" << endl;
+        return;
+    }
+
+    TapePtr<double> loaded = loadTape<double>(path);
+    if (!loaded) {
+        cout << "loadTape failed" << endl;
+        return;
+    }
+
+    Variable<double> loadedS1(loaded, s1.getNodeId());
+    Variable<double> loadedV3(loaded, v3.getNodeId());
+
+    loadedS1.setValue(6);
+    s1.setValue(6);
+    t->compute(&v3);
+    loaded->compute(&loadedV3);
+
+    cout << "loaded tape v3 == " << loadedV3.getValue() << endl;
+    cout << "gradient dv3/ds1 from loaded tape:" << endl;
+    cout << "  - prediction == " << loaded->gradient(loadedV3, loadedS1)
+         << endl;
+    cout << "  - actual     == " << t->gradient(v3, s1) << endl;
+}
+
+// copies the tape file at path with the first edge of node from pointed at
+// to, returns the new file's path
+string writeRedirectedEdge(const char *path, int from, int to) {
+    ifstream in(path, ios::binary);
+    vector<char> bytes((istreambuf_iterator<char>(in)),
+                       istreambuf_iterator<char>());
+
+    if (bytes.size() >= sizeof(TapeFileHeader)) {
+        const TapeFileHeader *header = (const TapeFileHeader *)bytes.data();
+        TapeFileNode *nodes =
+            (TapeFileNode *)(bytes.data() + sizeof(TapeFileHeader));
+        int32_t *edges = (int32_t *)(nodes + header->nodeCount);
+        edges[nodes[from].edgeBegin] = to;
+    }
+
+    string redirected = string(path) + ".cyclic";
+    ofstream(redirected, ios::binary).write(bytes.data(), bytes.size());
+
+    return redirected;
+}
+
+// malformed files are refused instead of handed to compute
+void loadRejectionTest() {
+    TapePtr<double> t(new Tape<double>());
+
+    Variable<double> s1(5, t);
+    Variable<double> pi(3.14, t);
+    auto v = s1 * pi;
+
+    const char *path = "/tmp/replicant_reject.bin";
+    if (!saveTape(*t, path)) {
+        cout << "saveTape failed" << endl;
+        return;
+    }
+
+    // the Multiply node is recorded right after its output
+    int op = v.getNodeId() + 1;
+    string selfEdge = writeRedirectedEdge(path, op, op);
+    string backEdge = writeRedirectedEdge(path, op, v.getNodeId());
+
+    cout << "loadTape rejects missing and cyclic files:" << endl;
+    cout << "  - prediction == " << !loadTape<double>("/nonexistent")
+         << !loadTape<double>(selfEdge) << !loadTape<double>(backEdge)
+         << !!loadTape<double>(path) << endl;
+    cout << "  - actual     == 1111" << endl;
+}
+
+void streamingTest() {
+    const int horizon = 64;
+    const int steps = 10000;
+    TapePtr<double> t(new Tape<double>(horizon));
+
+    Variable<double> w(1.0001, t);
+    Variable<double> v(1, t);
+    for (int i = 0; i < steps; i++) {
+        v = v * w;
+        t->compute(&v);
+    }
+
+    // every step adds an output node and a Multiply node, so the window
+    // holds the last horizon / 2 multiplications
+    const int window = horizon / 2;
+    const double boundary = pow(w.getValue(), steps - window);
+
+    cout << "streaming tape live nodes == " << t->getNodeCount() << endl;
+    cout << "truncated gradient dv/dw:" << endl;
+    cout << "  - prediction == " << t->gradient(v, w) << endl;
+    cout << "  - actual     == "
+         << window * pow(w.getValue(), window - 1) * boundary << endl;
+}
+
+// a parameter that has fallen out of the window is still written through
+// setValue, and the live part of the chain has to pick the new value up
+void streamingSetValueTest() {
+    TapePtr<double> t(new Tape<double>(8));
+
+    Variable<double> w(2, t);
+    Variable<double> v(1, t);
+    for (int i = 0; i < 10; i++) {
+        v = v * w;
+        t->compute(&v);
+    }
+
+    // the window holds the last 4 multiplications, the ones before are
+    // frozen at 2^6
+    w.setValue(3);
+    t->compute(&v);
+
+    cout << "streaming tape after setValue on a retired parameter:" << endl;
+    cout << "  - prediction == " << v.getValue() << endl;
+    cout << "  - actual     == " << pow(2, 6) * pow(3, 4) << endl;
+    cout << "  - prediction == " << t->gradient(v, w) << endl;
+    cout << "  - actual     == " << 4 * pow(2, 6) * pow(3, 3) << endl;
+}
+
+void profilerTest() {
+    TapePtr<double> t(new Tape<double>());
+    t->getProfiler().setEnabled(true);
+
+    Variable<double> s1(5, t);
+    Variable<double> pi(3.14, t);
+
+    auto v = s1 - pi;
+    auto v2 = v * s1;
+    auto v3 = v2 ^ pi;
+
+    t->compute(&v3);
+    t->gradient(v3, s1);
+    t->recordShape();
+
+    cout << "profile: ";
+    t->getProfiler().writeJson(cout);
+}
+
+void incrementalTest() {
+    TapePtr<double> t(new Tape<double>());
+    t->getProfiler().setEnabled(true);
+
+    Variable<double> a(2, t);
+    Variable<double> b(3, t);
+    Variable<double> c(4, t);
+
+    auto ab = a * b;
+    auto bc = b * c;
+    auto out = ab + bc;
+
+    t->compute(&out);
+
+    auto forwardCalls = [&]() {
+        int64_t calls = 0;
+        for (auto &[code, stats] : t->getProfiler().getOpStats()) {
+            calls += stats.forwardCalls;
+        }
+
+        return calls;
+    };
+
+    int64_t before = forwardCalls();
+    c.setValue(5);
+    t->compute(&out);
+
+    cout << "incremental recompute touched " << forwardCalls() - before
+         << " of " << t->getNodeCount() << " nodes" << endl;
+    cout << "out after c = 5:" << endl;
+    cout << "  - prediction == " << out.getValue() << endl;
+    cout << "  - actual     == " << 2 * 3 + 3 * 5 << endl;
+}
+
+void memoryPlanTest() {
+    auto build = [](Variable<double> &x) {
+        Variable<double> v = x;
+        for (int i = 0; i < 100; i++) {
+            v = v * x;
+            v = v + 0.5;
+        }
+
+        return v;
+    };
+
+    TapePtr<double> planned(new Tape<double>());
+    Variable<double> x(1.01, planned);
+    Variable<double> out = build(x);
+
+    TapePtr<double> reference(new Tape<double>());
+    Variable<double> referenceX(1.01, reference);
+    Variable<double> referenceOut = build(referenceX);
+
+    MemoryPlan<double> plan = planMemory(*planned, out);
+    applyPlan(*planned, plan);
+
+    planned->compute(&out);
+    reference->compute(&referenceOut);
+
+    cout << "memory plan intermediates " << plan.bytesBefore << " bytes -> "
+         << plan.bytesAfter << " bytes, " << plan.inPlace << " in place"
+         << endl;
+    cout << "planned gradient dout/dx:" << endl;
+    cout << "  - prediction == " << planned->gradient(out, x) << endl;
+    cout << "  - actual     == "
+         << reference->gradient(referenceOut, referenceX) << endl;
+}
+
+void loopTest() {
+    TapePtr<double> t(new Tape<double>());
+
+    Variable<double> v(1, t);
+    Variable<double> two(2, t);
+
+    // selfAssignmentTest without unrolling
+    auto out = loop(v, two, 10, [](Variable<double> &state,
+                                   Variable<double> &factor) {
+        return state * factor;
+    });
+
+    t->compute(&out);
+    cout << "loop v^10 == " << out.getValue() << " using "
+         << t->getNodeCount() << " tape nodes" << endl;
+    cout << "gradient dout/dtwo:" << endl;
+    cout << "  - prediction == " << t->gradient(out, two) << endl;
+    cout << "  - actual     == " << 10 * pow(2., 9) << endl;
+    cout << "gradient dout/dv:" << endl;
+    cout << "  - prediction == " << t->gradient(out, v) << endl;
+    cout << "  - actual     == " << pow(2., 10) << endl;
+}
+
+void jitTest() {
+    TapePtr<double> t(new Tape<double>());
+
+    Variable<double> s1(5, t);
+    Variable<double> pi(3.14, t);
+
+    auto v = s1 - pi;
+    auto v2 = pi + pi;
+    auto v3 = v / v2;
+    auto v4 = v * v3;
+    auto v5 = v4 ^ v3;
+
+    auto compiled = compileTape(*t, v5);
+    if (!compiled) {
+        cout << "compileTape failed" << endl;
+        return;
+    }
+
+    s1.setValue(6);
+    compiled->compute();
+    t->compute(&v5);
+
+    cout << "compiled v5 == " << compiled->getValue() << endl;
+    cout << "compiled gradient dv5/ds1:" << endl;
+    cout << "  - prediction == " << compiled->gradient(s1) << endl;
+    cout << "  - actual     == " << t->gradient(v5, s1) << endl;
+}
+
+void localTapeTest() {
+    TapePtr<double> t(new Tape<double>());
+    LocalTape<double> local;
+
+    Variable<double> s1(5, t);
+    Variable<double> pi(3.14, t);
+    auto v = s1 - pi;
+    auto v2 = pi + pi;
+    auto v5 = (v * (v / v2)) ^ (v / v2);
+
+    auto ls1 = local.variable(5);
+    auto lpi = local.variable(3.14);
+    auto lv = ls1 - lpi;
+    auto lv2 = lpi + lpi;
+    auto lv5 = (lv * (lv / lv2)) ^ (lv / lv2);
+
+    s1.setValue(6);
+    local.setValue(ls1, 6);
+    t->compute(&v5);
+    local.compute();
+
+    cout << "local v5:" << endl;
+    cout << "  - prediction == " << lv5.getValue() << endl;
+    cout << "  - actual     == " << v5.getValue() << endl;
+    cout << "local gradient dv5/ds1:" << endl;
+    cout << "  - prediction == " << local.gradient(lv5, ls1) << endl;
+    cout << "  - actual     == " << t->gradient(v5, s1) << endl;
+    cout << "local gradient dv5/dpi:" << endl;
+    cout << "  - prediction == " << local.gradient(lv5, lpi) << endl;
+    cout << "  - actual     == " << t->gradient(v5, pi) << endl;
+}
+
+void fusedOpsTest() {
+    const vector<double> logits = {0.5, -1.2, 2.0, 0.1, 0.7, -0.3};
+    const vector<int> labels = {2, 0};
+    const double h = 1e-6;
+
+    using Head = LocalVariable<double> (*)(const LocalVariable<double> &);
+    const pair<const char *, Head> heads[] = {
+        {"tanh, layerNorm",
+         [](const LocalVariable<double> &x) { return layerNorm(tanh(x), 3); }},
+        {"sigmoid, logSoftmax",
+         [](const LocalVariable<double> &x) {
+             return logSoftmax(sigmoid(x), 3);
+         }},
+        {"relu, softmax",
+         [](const LocalVariable<double> &x) { return softmax(relu(x), 3); }},
+        {"sigmoid, log",
+         [](const LocalVariable<double> &x) { return log(sigmoid(x)); }},
+    };
+
+    // analytic gradient of each head's cross entropy against central
+    // differences
+    for (auto &[name, head] : heads) {
+        LocalTape<double> t;
+        auto x = t.variable(logits);
+        auto loss = crossEntropy(head(x), labels);
+        t.backward(loss);
+
+        vector<double> analytic(t.getAdjoints(x), t.getAdjoints(x) + 6);
+
+        double error = 0;
+        for (int i = 0; i < 6; i++) {
+            vector<double> shifted = logits;
+            shifted[i] += h;
+            t.setValues(x, shifted);
+            t.compute();
+            double up = loss.getValue();
+
+            shifted[i] -= 2 * h;
+            t.setValues(x, shifted);
+            t.compute();
+            double down = loss.getValue();
+
+            error = max(error, fabs(analytic[i] - (up - down) / (2 * h)));
+        }
+
+        cout << "fused " << name << " gradient error < 1e-6:" << endl;
+        cout << "  - prediction == " << (error < 1e-6) << endl;
+        cout << "  - actual     == 1" << endl;
+    }
+}
+
+// largest difference between the tape's adjoints for every input and
+// central differences of loss
+double localGradientError(LocalTape<double> &t, LocalVariable<double> loss,
+                          vector<LocalVariable<double>> inputs) {
+    const double h = 1e-6;
+
+    t.backward(loss);
+
+    double error = 0;
+    for (auto &input : inputs) {
+        int n = t.getSize(input);
+        vector<double> data(t.getValues(input), t.getValues(input) + n);
+        vector<double> analytic(t.getAdjoints(input),
+                                t.getAdjoints(input) + n);
+
+        for (int i = 0; i < n; i++) {
+            vector<double> shifted = data;
+            shifted[i] += h;
+            t.setValues(input, shifted);
+            t.compute();
+            double up = loss.getValue();
+
+            shifted[i] -= 2 * h;
+            t.setValues(input, shifted);
+            t.compute();
+            double down = loss.getValue();
+
+            error = max(error, fabs(analytic[i] - (up - down) / (2 * h)));
+        }
+
+        t.setValues(input, data);
+    }
+
+    t.compute();
+    return error;
+}
+
+void convTest() {
+    ConvShape shape = conv2dShape(2, 2, 5, 5, 3, 3, 2, 1);
+
+    vector<double> input(shape.inputSize());
+    vector<double> filters(shape.weightSize());
+    vector<double> bias = {0.1, -0.2, 0.3};
+    fillUniform(input.data(), input.size(), -1, 1, 1, 1);
+    fillUniform(filters.data(), filters.size(), -1, 1, 2, 1);
+
+    LocalTape<double> t;
+    auto x = t.variable(input);
+    auto w = t.variable(filters);
+    auto b = t.variable(bias);
+    auto y = conv2d(x, w, b, shape);
+
+    // direct convolution for the forward pass
+    double error = 0;
+    const double *out = t.getValues(y);
+    for (int n = 0; n < shape.batch; n++) {
+        for (int f = 0; f < shape.filters; f++) {
+            for (int oi = 0; oi < shape.outH; oi++) {
+                for (int oj = 0; oj < shape.outW; oj++) {
+                    double sum = bias[f];
+                    for (int c = 0; c < shape.channels; c++) {
+                        for (int ki = 0; ki < 3; ki++) {
+                            for (int kj = 0; kj < 3; kj++) {
+                                int i = oi * 2 - 1 + ki;
+                                int j = oj * 2 - 1 + kj;
+                                if (i < 0 || i >= 5 || j < 0 || j >= 5) {
+                                    continue;
+                                }
+
+                                sum += input[((n * 2 + c) * 5 + i) * 5 + j] *
+                                       filters[((f * 2 + c) * 3 + ki) * 3 + kj];
+                            }
+                        }
+                    }
+
+                    error = max(error, fabs(*out++ - sum));
+                }
+            }
+        }
+    }
+
+    cout << "conv2d forward error < 1e-12:" << endl;
+    cout << "  - prediction == " << (error < 1e-12) << endl;
+    cout << "  - actual     == 1" << endl;
+
+    auto pooled = maxPool2d(y, pool2dShape(2, 3, 3, 3, 2, 1));
+    auto loss = crossEntropy(pooled, {4, 9});
+
+    error = localGradientError(t, loss, {x, w, b});
+    cout << "conv2d, maxPool2d gradient error < 1e-6:" << endl;
+    cout << "  - prediction == " << (error < 1e-6) << endl;
+    cout << "  - actual     == 1" << endl;
+
+    ConvShape shape1d = conv1dShape(2, 2, 9, 3, 3, 1, 1);
+    auto x1 = t.variable(vector<double>(input.begin(), input.begin() + 36));
+    auto w1 = t.variable(vector<double>(filters.begin(), filters.begin() + 18));
+    auto y1 = conv2d(x1, w1, shape1d);
+    auto loss1 = crossEntropy(avgPool2d(y1, pool1dShape(2, 3, 9, 3, 3)),
+                              {1, 7});
+
+    error = localGradientError(t, loss1, {x1, w1});
+    cout << "conv1d, avgPool1d gradient error < 1e-6:" << endl;
+    cout << "  - prediction == " << (error < 1e-6) << endl;
+    cout << "  - actual     == 1" << endl;
+}
+
+void embeddingTest() {
+    const double h = 1e-6;
+
+    Matrix<double> table(1000, 4);
+    fillUniform(table.getData(), 1000 * 4, -1, 1, 3, 1);
+
+    LocalTape<double> t;
+    auto rows = t.gather(table, {3, 7, 3});
+    auto loss = crossEntropy(tanh(rows), {0, 2, 1});
+    t.backward(loss);
+
+    SparseGradient<double> grad = t.sparseGradient(table);
+
+    cout << "embedding rows touched:" << endl;
+    cout << "  - prediction == " << grad.size() << endl;
+    cout << "  - actual     == 2" << endl;
+
+    double error = 0;
+    for (int k = 0; k < grad.size(); k++) {
+        for (int j = 0; j < table.cols; j++) {
+            double &value = table(grad.rows[k], j);
+
+            value += h;
+            t.compute();
+            double up = loss.getValue();
+
+            value -= 2 * h;
+            t.compute();
+            double down = loss.getValue();
+
+            value += h;
+            error = max(error, fabs(grad.row(k)[j] - (up - down) / (2 * h)));
+        }
+    }
+
+    cout << "embedding gradient error < 1e-6:" << endl;
+    cout << "  - prediction == " << (error < 1e-6) << endl;
+    cout << "  - actual     == 1" << endl;
+
+    // a few sparse steps should lower the loss
+    t.compute();
+    double before = loss.getValue();
+
+    SparseAdagrad<double> adagrad(table, 0.1);
+    for (int step = 0; step < 10; step++) {
+        t.compute();
+        t.backward(loss);
+        adagrad.update(table, t.sparseGradient(table));
+    }
+
+    t.compute();
+    cout << "embedding loss decreased with adagrad:" << endl;
+    cout << "  - prediction == " << (loss.getValue() < before) << endl;
+    cout << "  - actual     == 1" << endl;
+}
+
+void dataParallelTest() {
+    const int workers = 3;
+    const int n = 10;
+
+    // slots smaller than the buffer, uneven chunks and several rounds
+    auto comm = ShmCommunicator::create(workers, 4);
+    if (!comm) {
+        cout << "ShmCommunicator::create failed" << endl;
+        return;
+    }
+
+    bool ok = runWorkers(workers, [&](int rank) {
+        comm->setRank(rank);
+
+        // the others would wait on a worker that bails out
+        auto fail = [&] {
+            comm->abort();
+            return 1;
+        };
+
+        for (int round = 0; round < 3; round++) {
+            vector<double> data(n);
+            for (int i = 0; i < n; i++) {
+                data[i] = rank * 100 + i + round;
+            }
+
+            if (!comm->allReduce(data.data(), n)) {
+                return fail();
+            }
+            for (int i = 0; i < n; i++) {
+                if (data[i] != 300 + 3 * (i + round)) {
+                    return fail();
+                }
+            }
+        }
+
+        // averages land in out whichever bucket they went through
+        vector<double> grads = {1. + rank, 2. + rank, 3. + rank, 4. + rank};
+        vector<double> out(4);
+        GradientBuckets buckets(*comm, 3);
+        buckets.add(&grads[0], &out[0], 2);
+        buckets.add(&grads[2], &out[2], 1);
+        buckets.add(&grads[3], &out[3], 1);
+        if (!buckets.finish()) {
+            return fail();
+        }
+
+        for (int i = 0; i < 4; i++) {
+            if (out[i] != grads[i] - rank + 1) {
+                return fail();
+            }
+        }
+
+        return 0;
+    });
+
+    cout << "shared memory all-reduce across 3 workers:" << endl;
+    cout << "  - prediction == " << ok << endl;
+    cout << "  - actual     == 1" << endl;
+
+    // a worker leaving early must not hang the rest
+    auto broken = ShmCommunicator::create(workers, 4);
+    if (!broken) {
+        cout << "ShmCommunicator::create failed" << endl;
+        return;
+    }
+
+    bool failed = !runWorkers(workers, [&](int rank) {
+        broken->setRank(rank);
+        if (rank == 1) {
+            broken->abort();
+            return 1;
+        }
+
+        vector<double> data(n, rank);
+        return broken->allReduce(data.data(), n) ? 0 : 1;
+    });
+
+    cout << "all-reduce with a worker that gives up fails:" << endl;
+    cout << "  - prediction == " << failed << endl;
+    cout << "  - actual     == 1" << endl;
+}
@@ -0,0 +1,326 @@
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <new>
+
+#include "data_parallel.h"
+
+// the counters are shared between processes, which only works for atomics
+// that don't fall back to a lock
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
+static_assert(std::atomic<int>::is_always_lock_free);
+
+// one per worker, on its own cache line so neighbours don't false share
+struct alignas(64) ShmCommunicator::Counter {
+    std::atomic<uint64_t> steps;
+};
+
+// at the start of the segment, set once any worker gives up
+struct alignas(64) ShmCommunicator::Control {
+    std::atomic<int> aborted;
+};
+
+std::unique_ptr<ShmCommunicator> ShmCommunicator::create(int workers,
+                                                         size_t capacity) {
+    static std::atomic<int> segments(0);
+
+    char name[64];
+    snprintf(name, sizeof(name), "/replicant-%d-%d", (int)getpid(),
+             segments++);
+
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    size_t bytes = sizeof(Control) +
+                   workers * (sizeof(Counter) + capacity * sizeof(double));
+    void *memory = MAP_FAILED;
+    if (ftruncate(fd, bytes) == 0) {
+        memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                      0);
+    }
+
+    // the mapping outlives the name, and forked workers inherit it
+    close(fd);
+    shm_unlink(name);
+
+    if (memory == MAP_FAILED) {
+        return nullptr;
+    }
+
+    std::unique_ptr<ShmCommunicator> comm(new ShmCommunicator());
+    comm->memory = memory;
+    comm->bytes = bytes;
+    comm->workers = workers;
+    comm->rank = 0;
+    comm->capacity = capacity;
+    comm->control = new (memory) Control();
+    comm->control->aborted.store(0);
+    comm->counters = (Counter *)(comm->control + 1);
+    comm->slots = (double *)(comm->counters + workers);
+    comm->step = 0;
+
+    for (int i = 0; i < workers; i++) {
+        new (&comm->counters[i]) Counter();
+        comm->counters[i].steps.store(0);
+    }
+
+    return comm;
+}
+
+ShmCommunicator::~ShmCommunicator() {
+    munmap(memory, bytes);
+}
+
+void ShmCommunicator::setRank(int rank) {
+    this->rank = rank;
+}
+
+void ShmCommunicator::abort() {
+    control->aborted.store(1, std::memory_order_release);
+}
+
+bool ShmCommunicator::aborted() {
+    return control->aborted.load(std::memory_order_acquire) != 0;
+}
+
+// yields rather than spins, workers may outnumber cores. false if a worker
+// aborted, it may never get to the step waited for
+bool ShmCommunicator::waitFor(int worker, int64_t steps) {
+    while ((int64_t)counters[worker].steps.load(std::memory_order_acquire) <
+           steps) {
+        if (aborted()) {
+            return false;
+        }
+        sched_yield();
+    }
+
+    return true;
+}
+
+void ShmCommunicator::advance() {
+    counters[rank].steps.store(++step, std::memory_order_release);
+}
+
+bool ShmCommunicator::allReduce(double *data, size_t count) {
+    for (size_t begin = 0; begin < count; begin += capacity) {
+        if (!reducePiece(data + begin, std::min(capacity, count - begin))) {
+            return false;
+        }
+    }
+
+    return !aborted();
+}
+
+// a worker's step k reads what its left neighbour wrote at step k - 1, so
+// it waits for the neighbour to complete k steps. writing a chunk again in
+// the all-gather also waits until the right neighbour has read it in the
+// reduce-scatter, P - 2 steps back
+bool ShmCommunicator::reducePiece(double *data, size_t count) {
+    const int p = workers;
+    if (p == 1) {
+        return true;
+    }
+
+    const int left = (rank + p - 1) % p;
+    const int right = (rank + 1) % p;
+    double *mine = slots + rank * capacity;
+    const double *theirs = slots + left * capacity;
+
+    auto chunk = [&](int c) {
+        c = ((c % p) + p) % p;
+        return std::make_pair(c * count / p, (c + 1) * count / p);
+    };
+
+    // the right neighbour may still be reading the previous call's values
+    if (!waitFor(right, step)) {
+        return false;
+    }
+    std::copy(data, data + count, mine);
+    advance();
+
+    for (int j = 0; j < 2 * (p - 1); j++) {
+        if (!waitFor(left, step) || !waitFor(right, (int64_t)step - p + 2)) {
+            return false;
+        }
+
+        if (j < p - 1) {
+            auto [begin, end] = chunk(rank - j - 1);
+            for (size_t i = begin; i < end; i++) {
+                mine[i] += theirs[i];
+            }
+        } else {
+            auto [begin, end] = chunk(rank - (j - (p - 1)));
+            std::copy(theirs + begin, theirs + end, mine + begin);
+        }
+
+        advance();
+    }
+
+    std::copy(mine, mine + count, data);
+    return true;
+}
+
+GradientBuckets::GradientBuckets(ShmCommunicator &comm, size_t bucketSize)
+    : comm(comm), bucketSize(bucketSize), pending(0), failed(false),
+      stopping(false) {
+    reducer = std::thread(&GradientBuckets::run, this);
+}
+
+GradientBuckets::~GradientBuckets() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+
+    wake.notify_one();
+    reducer.join();
+}
+
+void GradientBuckets::add(const double *grad, double *out, size_t count) {
+    current.values.insert(current.values.end(), grad, grad + count);
+    current.outputs.emplace_back(out, count);
+
+    if (current.values.size() >= bucketSize) {
+        flush();
+    }
+}
+
+void GradientBuckets::flush() {
+    if (current.values.empty()) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(std::move(current));
+        pending++;
+    }
+
+    current = Bucket();
+    wake.notify_one();
+}
+
+bool GradientBuckets::finish() {
+    flush();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    drained.wait(lock, [this] { return pending == 0; });
+
+    return !failed;
+}
+
+// buckets are reduced in the order they were added, which is the same on
+// every worker
+void GradientBuckets::run() {
+    const double scale = 1.0 / comm.getWorkers();
+
+    while (true) {
+        Bucket bucket;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (queue.empty()) {
+                return;
+            }
+
+            bucket = std::move(queue.front());
+            queue.pop_front();
+        }
+
+        // once a reduction fails the rest are dropped, the other workers
+        // are no longer in step
+        bool ok = !failed && comm.allReduce(bucket.values.data(),
+                                            bucket.values.size());
+
+        const double *value = bucket.values.data();
+        for (auto &[out, count] : bucket.outputs) {
+            for (size_t i = 0; ok && i < count; i++) {
+                out[i] = *value++ * scale;
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            failed = failed || !ok;
+            pending--;
+        }
+        drained.notify_all();
+    }
+}
+
+bool runWorkers(int workers, const std::function<int(int)> &body) {
+    std::vector<pid_t> children;
+
+    bool ok = true;
+    for (int rank = 0; rank < workers; rank++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            _exit(body(rank));
+        }
+        // the rest would wait for the missing worker forever
+        if (pid < 0) {
+            for (pid_t child : children) {
+                kill(child, SIGKILL);
+            }
+
+            ok = false;
+            break;
+        }
+
+        children.push_back(pid);
+    }
+
+    // a worker that fails may leave the others waiting on it, so the first
+    // failure takes the rest down
+    while (!children.empty()) {
+        bool reaped = false;
+
+        for (size_t i = 0; i < children.size(); i++) {
+            int status = 0;
+            pid_t pid = waitpid(children[i], &status, WNOHANG);
+            if (pid == 0) {
+                continue;
+            }
+
+            if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                for (pid_t child : children) {
+                    if (child != children[i]) {
+                        kill(child, SIGKILL);
+                    }
+                }
+                ok = false;
+            }
+
+            children.erase(children.begin() + i--);
+            reaped = true;
+        }
+
+        if (!reaped) {
+            usleep(1000);
+        }
+    }
+
+    return ok;
+}
+
+std::shared_ptr<double> sharedArray(size_t n) {
+    size_t bytes = std::max<size_t>(n, 1) * sizeof(double);
+    void *memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return nullptr;
+    }
+
+    return std::shared_ptr<double>((double *)memory, [bytes](double *p) {
+        munmap(p, bytes);
+    });
+}
@@ -1,5 +1,11 @@
+#include <atomic>
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include "generation.h"
 
 int randBinary() {
     const int divisor = RAND_MAX / (2);
@@ -24,3 +30,158 @@ double marsagliaPolar() {
 
     return U * sqrtf(-2 * logf(S) / S);
 }
+
+// number of values drawn from a single substream.
+// changing this changes the generated values, so it is fixed
+static const size_t BLOCK_SIZE = 1 << 14;
+
+static uint64_t splitMix64(uint64_t &state) {
+    uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+
+    return z ^ (z >> 31);
+}
+
+// xoshiro256** seeded per block through splitmix64
+class BlockStream {
+    uint64_t s[4];
+
+    static uint64_t rotl(uint64_t x, int k) {
+        return (x << k) | (x >> (64 - k));
+    }
+
+  public:
+    BlockStream(uint64_t seed, uint64_t block) {
+        uint64_t state = seed ^ (block * 0xd1b54a32d192ed03ULL);
+        for (int i = 0; i < 4; i++) {
+            s[i] = splitMix64(state);
+        }
+    }
+
+    uint64_t next() {
+        const uint64_t result = rotl(s[1] * 5, 7) * 9;
+        const uint64_t t = s[1] << 17;
+
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
+
+        return result;
+    }
+
+    // uniform in [0, 1) with 53 bits of precision
+    double uniform() {
+        return (next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    // same polar method as marsagliaPolar, but keeps the second sample
+    void normalPair(double &a, double &b) {
+        double U, V, S;
+        do {
+            U = 2 * uniform() - 1;
+            V = 2 * uniform() - 1;
+            S = U * U + V * V;
+        } while (S >= 1 || S == 0);
+
+        double scale = sqrt(-2 * log(S) / S);
+        a = U * scale;
+        b = V * scale;
+    }
+};
+
+// hands out blocks to worker threads; fill(block, begin, end) must only
+// depend on its arguments for the output to be reproducible
+template <typename F>
+static void parallelBlocks(size_t n, int threads, F fill) {
+    size_t blockCount = (n + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (threads <= 0) {
+        threads = std::thread::hardware_concurrency();
+    }
+    if (threads <= 0) {
+        threads = 1;
+    }
+    if ((size_t)threads > blockCount) {
+        threads = blockCount;
+    }
+
+    std::atomic<size_t> nextBlock(0);
+    auto worker = [&]() {
+        size_t block;
+        while ((block = nextBlock.fetch_add(1)) < blockCount) {
+            size_t begin = block * BLOCK_SIZE;
+            size_t end = begin + BLOCK_SIZE < n ? begin + BLOCK_SIZE : n;
+            fill(block, begin, end);
+        }
+    };
+
+    if (threads <= 1) {
+        worker();
+        return;
+    }
+
+    std::vector<std::thread> pool;
+    for (int i = 1; i < threads; i++) {
+        pool.emplace_back(worker);
+    }
+
+    worker();
+
+    for (auto &t : pool) {
+        t.join();
+    }
+}
+
+void fillUniform(double *data, size_t n, double low, double high,
+                 uint64_t seed, int threads) {
+    const double range = high - low;
+    parallelBlocks(n, threads, [=](size_t block, size_t begin, size_t end) {
+        BlockStream stream(seed, block);
+        for (size_t i = begin; i < end; i++) {
+            data[i] = low + range * stream.uniform();
+        }
+    });
+}
+
+void fillNormal(double *data, size_t n, double mean, double stddev,
+                uint64_t seed, int threads) {
+    parallelBlocks(n, threads, [=](size_t block, size_t begin, size_t end) {
+        BlockStream stream(seed, block);
+        double a, b;
+        size_t i = begin;
+        for (; i + 1 < end; i += 2) {
+            stream.normalPair(a, b);
+            data[i] = mean + stddev * a;
+            data[i + 1] = mean + stddev * b;
+        }
+
+        if (i < end) {
+            stream.normalPair(a, b);
+            data[i] = mean + stddev * a;
+        }
+    });
+}
+
+void xavierUniform(double *data, size_t n, int fanIn, int fanOut,
+                   uint64_t seed, int threads) {
+    double limit = sqrt(6.0 / (fanIn + fanOut));
+    fillUniform(data, n, -limit, limit, seed, threads);
+}
+
+void xavierNormal(double *data, size_t n, int fanIn, int fanOut,
+                  uint64_t seed, int threads) {
+    fillNormal(data, n, 0, sqrt(2.0 / (fanIn + fanOut)), seed, threads);
+}
+
+void heUniform(double *data, size_t n, int fanIn, uint64_t seed,
+               int threads) {
+    double limit = sqrt(6.0 / fanIn);
+    fillUniform(data, n, -limit, limit, seed, threads);
+}
+
+void heNormal(double *data, size_t n, int fanIn, uint64_t seed, int threads) {
+    fillNormal(data, n, 0, sqrt(2.0 / fanIn), seed, threads);
+}